@@ -0,0 +1,207 @@
+#pragma once
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "thread_pool.h"
+
+// Lazily started coroutine returning a T. A Task can be co_awaited from
+// another coroutine, or started with start() and polled with done().
+template <typename T = void>
+class Task;
+
+namespace detail {
+
+template <typename T>
+struct TaskPromiseBase
+{
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+		template <typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+			auto& promise = h.promise();
+			// The frame may be destroyed as soon as finished is set
+			std::coroutine_handle<> continuation = promise.continuation;
+			promise.finished.store(true, std::memory_order_release);
+			return continuation ? continuation : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { exception = std::current_exception(); }
+
+	std::coroutine_handle<> continuation;
+	std::exception_ptr exception;
+	std::atomic<bool> finished = false;
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase<T>
+{
+	Task<T> get_return_object();
+	void return_value(T v) { value.emplace(std::move(v)); }
+	T result() {
+		if (this->exception)
+			std::rethrow_exception(this->exception);
+		return std::move(*value);
+	}
+
+	std::optional<T> value;
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase<void>
+{
+	Task<void> get_return_object();
+	void return_void() {}
+	void result() {
+		if (exception)
+			std::rethrow_exception(exception);
+	}
+};
+
+}
+
+template <typename T>
+class Task
+{
+public:
+	using promise_type = detail::TaskPromise<T>;
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	Task() {}
+	explicit Task(handle_type handle) : handle(handle) {}
+	Task(Task&& other) noexcept
+		: handle(std::exchange(other.handle, nullptr)), started(other.started) {}
+	Task& operator=(Task&& other) noexcept {
+		if (this != &other) {
+			reset();
+			handle = std::exchange(other.handle, nullptr);
+			started = other.started;
+		}
+		return *this;
+	}
+	~Task() { reset(); }
+
+	explicit operator bool() const { return bool(handle); }
+	// Run until the first suspension point, for tasks that aren't awaited
+	void start() {
+		started = true;
+		handle.resume();
+	}
+	bool done() const {
+		return handle && handle.promise().finished.load(std::memory_order_acquire);
+	}
+	// Only valid once done() is true
+	T result() { return handle.promise().result(); }
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) {
+		started = true;
+		handle.promise().continuation = continuation;
+		return handle;
+	}
+	T await_resume() { return handle.promise().result(); }
+
+private:
+	void reset() {
+		// A task that is still running elsewhere can't be destroyed safely,
+		// so its frame is abandoned instead
+		if (handle && (!started || done()))
+			handle.destroy();
+		handle = nullptr;
+	}
+
+	handle_type handle;
+	bool started = false;
+};
+
+namespace detail {
+
+template <typename T>
+inline Task<T> TaskPromise<T>::get_return_object() {
+	return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+	return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+}
+
+// Coroutines waiting to run on the main (GL context) thread. The render loop
+// calls poll() once per frame.
+class MainThreadQueue
+{
+public:
+	void post(std::coroutine_handle<> handle) {
+		std::lock_guard lock(mutex);
+		queue.push_back(handle);
+	}
+	// Resumes everything posted before the call; anything posted while
+	// resuming waits for the next poll
+	void poll() {
+		{
+			std::lock_guard lock(mutex);
+			std::swap(queue, running);
+		}
+		for (auto handle : running)
+			handle.resume();
+		running.clear();
+	}
+
+	// Polls until the task is done, e.g. to let a load finish before the GL
+	// context goes away
+	template <typename T>
+	void drain(const Task<T>& task) {
+		while (task && !task.done()) {
+			poll();
+			std::this_thread::yield();
+		}
+	}
+
+	// Pool workers post here, so create this before ThreadPool::shared();
+	// it is then destroyed after the pool has joined them
+	static MainThreadQueue& shared() {
+		static MainThreadQueue queue;
+		return queue;
+	}
+
+private:
+	std::mutex mutex;
+	std::vector<std::coroutine_handle<>> queue;
+	std::vector<std::coroutine_handle<>> running;
+};
+
+// co_await switchTo(pool) continues the coroutine on a worker thread
+inline auto switchTo(ThreadPool& pool) {
+	struct Awaiter {
+		ThreadPool& pool;
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> handle) {
+			pool.submit([handle] { handle.resume(); });
+		}
+		void await_resume() const noexcept {}
+	};
+	return Awaiter{ pool };
+}
+
+// co_await switchToMainThread() continues the coroutine in the next
+// MainThreadQueue::poll(), so it also works as "wait for the next frame"
+inline auto switchToMainThread(MainThreadQueue& queue = MainThreadQueue::shared()) {
+	struct Awaiter {
+		MainThreadQueue& queue;
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> handle) { queue.post(handle); }
+		void await_resume() const noexcept {}
+	};
+	return Awaiter{ queue };
+}
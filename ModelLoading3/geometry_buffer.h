@@ -0,0 +1,358 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <glad/glad.h>
+
+#include "gl_handle.h"
+#include "instance_buffer.h"
+#include "vertex.h"
+
+// One draw of glMultiDrawElementsIndirect, in the layout it reads
+struct DrawElementsIndirectCommand
+{
+	GLuint count;
+	GLuint instanceCount;
+	GLuint firstIndex;
+	GLint baseVertex;
+	GLuint baseInstance;
+};
+
+// First-fit allocator for ranges of [0, capacity), with coalescing frees
+class RangeAllocator
+{
+public:
+	static constexpr size_t NONE = SIZE_MAX;
+
+	explicit RangeAllocator(size_t capacity = 0) { reset(capacity); }
+	void reset(size_t capacity);
+	// Returns the offset of the new range, or NONE if nothing fits
+	size_t allocate(size_t size, size_t alignment = 1);
+	void free(size_t offset, size_t size);
+	void grow(size_t newCapacity);
+	size_t capacity() const { return capacity_; }
+	size_t used() const { return used_; }
+	size_t largestFree() const;
+
+private:
+	std::map<size_t, size_t> freeRanges; // offset -> size
+	size_t capacity_ = 0;
+	size_t used_ = 0;
+};
+
+inline void RangeAllocator::reset(size_t capacity)
+{
+	freeRanges.clear();
+	capacity_ = capacity;
+	used_ = 0;
+	if (capacity > 0)
+		freeRanges[0] = capacity;
+}
+
+inline size_t RangeAllocator::allocate(size_t size, size_t alignment)
+{
+	if (size == 0)
+		return 0;
+	for (auto it = freeRanges.begin(); it != freeRanges.end(); ++it) {
+		auto [start, rangeSize] = *it;
+		size_t offset = (start + alignment - 1) / alignment * alignment;
+		size_t padding = offset - start;
+		if (rangeSize < padding + size)
+			continue;
+		freeRanges.erase(it);
+		if (padding > 0)
+			freeRanges[start] = padding;
+		if (rangeSize > padding + size)
+			freeRanges[offset + size] = rangeSize - padding - size;
+		used_ += size;
+		return offset;
+	}
+	return NONE;
+}
+
+inline void RangeAllocator::free(size_t offset, size_t size)
+{
+	if (size == 0)
+		return;
+	used_ -= size;
+	auto next = freeRanges.lower_bound(offset);
+	// merge with the following range
+	if (next != freeRanges.end() && next->first == offset + size) {
+		size += next->second;
+		next = freeRanges.erase(next);
+	}
+	// merge with the preceding range
+	if (next != freeRanges.begin()) {
+		auto prev = std::prev(next);
+		if (prev->first + prev->second == offset) {
+			prev->second += size;
+			return;
+		}
+	}
+	freeRanges[offset] = size;
+}
+
+inline void RangeAllocator::grow(size_t newCapacity)
+{
+	if (newCapacity <= capacity_)
+		return;
+	size_t oldCapacity = capacity_;
+	capacity_ = newCapacity;
+	used_ += newCapacity - oldCapacity;
+	free(oldCapacity, newCapacity - oldCapacity);
+}
+
+inline size_t RangeAllocator::largestFree() const
+{
+	size_t largest = 0;
+	for (auto [offset, size] : freeRanges)
+		largest = std::max(largest, size);
+	return largest;
+}
+
+
+// Vertex and index buffers shared by many meshes, with a single VAO. Meshes
+// are sub-allocated and drawn with a base vertex. Allocations are referred
+// to by id, so compact() can move them. All vertices share one VertexFormat;
+// quantized positions are relative to each allocation's own bounds.
+class GeometryBuffer : public std::enable_shared_from_this<GeometryBuffer>
+{
+public:
+	using Id = uint32_t;
+	static constexpr Id INVALID_ID = UINT32_MAX;
+
+	struct Range {
+		GLint baseVertex = 0;
+		GLsizei vertexCount = 0;
+		size_t indexOffset = 0; // in bytes
+		GLsizei indexCount = 0;
+		GLenum indexType = GL_UNSIGNED_INT;
+		VertexQuantization quantization;
+	};
+
+	// Frees its range when destroyed
+	class Allocation {
+	public:
+		Allocation() {}
+		Allocation(std::shared_ptr<GeometryBuffer> buffer, Id id)
+			: buffer(std::move(buffer)), id(id) {}
+		Allocation(Allocation&& other) noexcept
+			: buffer(std::move(other.buffer)), id(std::exchange(other.id, INVALID_ID)) {}
+		Allocation& operator=(Allocation&& other) noexcept {
+			if (this != &other) {
+				release();
+				buffer = std::move(other.buffer);
+				id = std::exchange(other.id, INVALID_ID);
+			}
+			return *this;
+		}
+		~Allocation() { release(); }
+
+		explicit operator bool() const { return buffer && id != INVALID_ID; }
+		GeometryBuffer* geometry() const { return buffer.get(); }
+		const Range& range() const { return buffer->range(id); }
+		void release() {
+			if (*this)
+				buffer->free(id);
+			buffer.reset();
+			id = INVALID_ID;
+		}
+
+	private:
+		std::shared_ptr<GeometryBuffer> buffer;
+		Id id = INVALID_ID;
+	};
+
+	// The index capacity is in bytes, since meshes choose their own index type
+	static std::shared_ptr<GeometryBuffer> create(size_t vertexCapacity = 1 << 16,
+		size_t indexCapacity = 1 << 20, const VertexFormat& format = VertexFormat()) {
+		return std::shared_ptr<GeometryBuffer>(
+			new GeometryBuffer(vertexCapacity, indexCapacity, format));
+	}
+	GeometryBuffer(const GeometryBuffer&) = delete;
+	GeometryBuffer& operator=(const GeometryBuffer&) = delete;
+
+	Allocation allocate(const std::vector<Vertex>& vertices,
+		const std::vector<unsigned int>& indices);
+	const Range& range(Id id) const { return ranges[id]; }
+	// Packs all live ranges to the start of new, tightly sized buffers
+	void compact();
+	void bind() const { GLState::shared().bindVertexArray(vao.get()); }
+	const VertexFormat& format() const { return format_; }
+	// Changes whenever compact() moves ranges, which invalidates draw
+	// commands built from them
+	uint64_t generation() const { return generation_; }
+	// Instance attributes of the shared VAO
+	InstanceBuffer& instanceBuffer() { return instances; }
+
+	size_t vertexCapacity() const { return vertexAlloc.capacity(); }
+	size_t indexCapacity() const { return indexAlloc.capacity(); }
+	size_t verticesUsed() const { return vertexAlloc.used(); }
+	size_t indexBytesUsed() const { return indexAlloc.used(); }
+
+private:
+	GeometryBuffer(size_t vertexCapacity, size_t indexCapacity, const VertexFormat& format);
+	void free(Id id);
+	void setupVertexArray();
+	void resize(size_t newVertexCapacity, size_t newIndexCapacity);
+
+	VertexArrayHandle vao;
+	BufferHandle vbo, ebo;
+	InstanceBuffer instances;
+	uint64_t generation_ = 0;
+	VertexFormat format_;
+	size_t stride;
+	RangeAllocator vertexAlloc; // in vertices
+	RangeAllocator indexAlloc; // in bytes
+	std::vector<Range> ranges;
+	std::vector<Id> freeIds;
+	std::vector<bool> live;
+};
+
+inline GeometryBuffer::GeometryBuffer(size_t vertexCapacity, size_t indexCapacity,
+	const VertexFormat& format)
+	: vao(createVertexArray()), format_(format), stride(format.stride())
+{
+	resize(std::max<size_t>(vertexCapacity, 1), std::max<size_t>(indexCapacity, 1));
+}
+
+inline GeometryBuffer::Allocation GeometryBuffer::allocate(
+	const std::vector<Vertex>& vertices, const std::vector<unsigned int>& indices)
+{
+	GLenum indexType = indexTypeFor(vertices.size());
+	size_t alignment = indexSize(indexType);
+	size_t indexBytes = indices.size() * alignment;
+	size_t vertexOffset = vertexAlloc.allocate(vertices.size());
+	size_t indexOffset = indexAlloc.allocate(indexBytes, alignment);
+	if (vertexOffset == RangeAllocator::NONE || indexOffset == RangeAllocator::NONE) {
+		// Grow to fit; anything already allocated in this call is undone
+		if (vertexOffset != RangeAllocator::NONE)
+			vertexAlloc.free(vertexOffset, vertices.size());
+		if (indexOffset != RangeAllocator::NONE)
+			indexAlloc.free(indexOffset, indexBytes);
+		resize(std::max(vertexCapacity() * 2, vertexCapacity() + vertices.size()),
+			std::max(indexCapacity() * 2, indexCapacity() + indexBytes + alignment));
+		vertexOffset = vertexAlloc.allocate(vertices.size());
+		indexOffset = indexAlloc.allocate(indexBytes, alignment);
+	}
+
+	Id id;
+	if (!freeIds.empty()) {
+		id = freeIds.back();
+		freeIds.pop_back();
+	}
+	else {
+		id = Id(ranges.size());
+		ranges.emplace_back();
+		live.push_back(false);
+	}
+	std::vector<unsigned char> packed;
+	VertexQuantization quantization = format_.pack(vertices, packed);
+	ranges[id] = { GLint(vertexOffset), GLsizei(vertices.size()),
+		indexOffset, GLsizei(indices.size()), indexType, quantization };
+	live[id] = true;
+
+	// The copy targets aren't part of VAO state, unlike GL_ELEMENT_ARRAY_BUFFER
+	glBindBuffer(GL_COPY_WRITE_BUFFER, vbo.get());
+	glBufferSubData(GL_COPY_WRITE_BUFFER, vertexOffset * stride,
+		packed.size(), packed.data());
+	packIndices(indices, indexType, packed);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, ebo.get());
+	glBufferSubData(GL_COPY_WRITE_BUFFER, indexOffset, packed.size(), packed.data());
+	return Allocation(shared_from_this(), id);
+}
+
+inline void GeometryBuffer::free(Id id)
+{
+	Range& r = ranges[id];
+	vertexAlloc.free(size_t(r.baseVertex), size_t(r.vertexCount));
+	indexAlloc.free(r.indexOffset, r.indexCount * indexSize(r.indexType));
+	r = Range();
+	live[id] = false;
+	freeIds.push_back(id);
+}
+
+inline void GeometryBuffer::compact()
+{
+	size_t numVertices = vertexAlloc.used(), indexBytes = indexAlloc.used();
+	BufferHandle newVbo = createBuffer(), newEbo = createBuffer();
+	glBindBuffer(GL_COPY_WRITE_BUFFER, newVbo.get());
+	glBufferData(GL_COPY_WRITE_BUFFER, std::max<size_t>(numVertices, 1) * stride,
+		nullptr, GL_STATIC_DRAW);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, newEbo.get());
+	glBufferData(GL_COPY_WRITE_BUFFER, std::max<size_t>(indexBytes, 1), nullptr, GL_STATIC_DRAW);
+
+	// 32-bit index ranges go first, so no range needs alignment padding
+	size_t vertexOffset = 0, indexOffset = 0;
+	for (GLenum type : { GL_UNSIGNED_INT, GL_UNSIGNED_SHORT }) {
+		for (Id id = 0; id < ranges.size(); id++) {
+			Range& r = ranges[id];
+			if (!live[id] || r.indexType != type)
+				continue;
+			size_t rangeBytes = r.indexCount * indexSize(r.indexType);
+			glBindBuffer(GL_COPY_READ_BUFFER, vbo.get());
+			glBindBuffer(GL_COPY_WRITE_BUFFER, newVbo.get());
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+				r.baseVertex * stride, vertexOffset * stride, r.vertexCount * stride);
+			glBindBuffer(GL_COPY_READ_BUFFER, ebo.get());
+			glBindBuffer(GL_COPY_WRITE_BUFFER, newEbo.get());
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+				r.indexOffset, indexOffset, rangeBytes);
+			r.baseVertex = GLint(vertexOffset);
+			r.indexOffset = indexOffset;
+			vertexOffset += r.vertexCount;
+			indexOffset += rangeBytes;
+		}
+	}
+
+	vbo = std::move(newVbo);
+	ebo = std::move(newEbo);
+	vertexAlloc.reset(std::max<size_t>(numVertices, 1));
+	indexAlloc.reset(std::max<size_t>(indexBytes, 1));
+	vertexAlloc.allocate(numVertices);
+	indexAlloc.allocate(indexBytes);
+	setupVertexArray();
+	generation_++;
+}
+
+inline void GeometryBuffer::resize(size_t newVertexCapacity, size_t newIndexCapacity)
+{
+	BufferHandle newVbo = createBuffer(), newEbo = createBuffer();
+	glBindBuffer(GL_COPY_WRITE_BUFFER, newVbo.get());
+	glBufferData(GL_COPY_WRITE_BUFFER, newVertexCapacity * stride, nullptr, GL_STATIC_DRAW);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, newEbo.get());
+	glBufferData(GL_COPY_WRITE_BUFFER, newIndexCapacity, nullptr, GL_STATIC_DRAW);
+
+	// Existing ranges keep their offsets
+	if (vbo) {
+		glBindBuffer(GL_COPY_READ_BUFFER, vbo.get());
+		glBindBuffer(GL_COPY_WRITE_BUFFER, newVbo.get());
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+			vertexCapacity() * stride);
+		glBindBuffer(GL_COPY_READ_BUFFER, ebo.get());
+		glBindBuffer(GL_COPY_WRITE_BUFFER, newEbo.get());
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+			indexCapacity());
+	}
+	vbo = std::move(newVbo);
+	ebo = std::move(newEbo);
+	vertexAlloc.grow(newVertexCapacity);
+	indexAlloc.grow(newIndexCapacity);
+	setupVertexArray();
+}
+
+inline void GeometryBuffer::setupVertexArray()
+{
+	GLState::shared().bindVertexArray(vao.get());
+	glBindBuffer(GL_ARRAY_BUFFER, vbo.get());
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo.get());
+	format_.setupAttributes();
+	GLState::shared().bindVertexArray(0);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <utility>
+
+#include <glad/glad.h>
+
+#include "gl_state.h"
+
+// Move-only owner of a GL object name, which is deleted with Deleter when the
+// handle is destroyed or reset. Like the objects themselves, handles may only
+// be destroyed on the GL context thread.
+template <typename Deleter>
+class GLHandle
+{
+public:
+	GLHandle() {}
+	explicit GLHandle(GLuint id) : id(id) {}
+	GLHandle(GLHandle&& other) noexcept : id(std::exchange(other.id, 0)) {}
+	GLHandle& operator=(GLHandle&& other) noexcept {
+		if (this != &other)
+			reset(std::exchange(other.id, 0));
+		return *this;
+	}
+	GLHandle(const GLHandle&) = delete;
+	GLHandle& operator=(const GLHandle&) = delete;
+	~GLHandle() { reset(); }
+
+	GLuint get() const { return id; }
+	explicit operator bool() const { return id != 0; }
+	void reset(GLuint newId = 0) {
+		if (id)
+			Deleter()(id);
+		id = newId;
+	}
+	// Gives up ownership without deleting the object
+	GLuint release() { return std::exchange(id, 0); }
+
+private:
+	GLuint id = 0;
+};
+
+namespace detail {
+
+struct BufferDeleter {
+	void operator()(GLuint id) const { glDeleteBuffers(1, &id); }
+};
+struct VertexArrayDeleter {
+	void operator()(GLuint id) const {
+		glDeleteVertexArrays(1, &id);
+		GLState::shared().forgetVertexArray(id);
+	}
+};
+struct TextureDeleter {
+	void operator()(GLuint id) const {
+		glDeleteTextures(1, &id);
+		GLState::shared().forgetTexture(id);
+	}
+};
+struct ShaderDeleter {
+	void operator()(GLuint id) const { glDeleteShader(id); }
+};
+struct ProgramDeleter {
+	void operator()(GLuint id) const { glDeleteProgram(id); }
+};
+
+}
+
+using BufferHandle = GLHandle<detail::BufferDeleter>;
+using VertexArrayHandle = GLHandle<detail::VertexArrayDeleter>;
+using TextureHandle = GLHandle<detail::TextureDeleter>;
+using ShaderHandle = GLHandle<detail::ShaderDeleter>;
+using ProgramHandle = GLHandle<detail::ProgramDeleter>;
+
+inline BufferHandle createBuffer()
+{
+	GLuint id = 0;
+	glGenBuffers(1, &id);
+	return BufferHandle(id);
+}
+
+inline VertexArrayHandle createVertexArray()
+{
+	GLuint id = 0;
+	glGenVertexArrays(1, &id);
+	return VertexArrayHandle(id);
+}
+
+inline TextureHandle createTexture()
+{
+	GLuint id = 0;
+	glGenTextures(1, &id);
+	return TextureHandle(id);
+}
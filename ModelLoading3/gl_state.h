@@ -0,0 +1,218 @@
+#pragma once
+
+#include <cstddef>
+#include <unordered_map>
+
+#include <glad/glad.h>
+
+// Mirror of the GL state that drawing changes most: the program, vertex
+// array, texture of each unit, viewport, enabled capabilities, cull face,
+// blend function and depth state. Setting state the GL already has makes no
+// call, and queries are answered from the mirror instead of stalling on
+// glGet. That only holds while every change goes through here; call
+// invalidate() after anything else changes this state. Use from the GL
+// context thread.
+class GLState
+{
+public:
+	static constexpr GLuint MAX_TEXTURE_UNITS = 32;
+
+	struct Viewport {
+		GLint x = 0, y = 0;
+		GLsizei width = 0, height = 0;
+		bool operator==(const Viewport&) const = default;
+	};
+
+	// GL calls made and skipped, see takeStats()
+	struct Stats {
+		size_t issued = 0;
+		size_t elided = 0;
+	};
+
+	GLState() { invalidate(); }
+	static GLState& shared();
+
+	void useProgram(GLuint program);
+	void bindVertexArray(GLuint vertexArray);
+	// Binds a GL_TEXTURE_2D texture, activating the unit only if it changes
+	void bindTexture(GLuint unit, GLuint texture);
+	void setViewport(const Viewport& viewport);
+	void setViewport(GLint x, GLint y, GLsizei width, GLsizei height) {
+		setViewport(Viewport{ x, y, width, height });
+	}
+	void setEnabled(GLenum capability, bool enabled);
+	void enable(GLenum capability) { setEnabled(capability, true); }
+	void disable(GLenum capability) { setEnabled(capability, false); }
+	void cullFace(GLenum mode);
+	void blendFunc(GLenum source, GLenum destination);
+	void depthFunc(GLenum func);
+	void depthMask(bool write);
+
+	// Queried from the GL only the first time after invalidate()
+	const Viewport& viewport();
+	bool isEnabled(GLenum capability);
+
+	// Deleted objects are unbound by the GL, and their names reused
+	void forgetTexture(GLuint texture);
+	void forgetVertexArray(GLuint vertexArray);
+
+	// Forgets all state, so the next change of each kind always reaches the GL
+	void invalidate();
+	// The stats since the last call, e.g. for one frame
+	Stats takeStats();
+
+private:
+	// Counts the call, and returns whether it has to be made
+	bool change(bool same) {
+		(same ? stats.elided : stats.issued)++;
+		return !same;
+	}
+
+	static constexpr GLuint UNKNOWN = ~0u;
+
+	GLuint program;
+	GLuint vertexArray;
+	GLuint activeUnit;
+	GLuint textures[MAX_TEXTURE_UNITS];
+	Viewport view;
+	bool viewKnown;
+	std::unordered_map<GLenum, bool> capabilities;
+	GLenum cullMode, depthFunction;
+	GLenum blendSource, blendDestination;
+	int depthWrite;
+	Stats stats;
+};
+
+inline GLState& GLState::shared()
+{
+	static GLState state;
+	return state;
+}
+
+inline void GLState::useProgram(GLuint id)
+{
+	if (change(program == id))
+		glUseProgram(program = id);
+}
+
+inline void GLState::bindVertexArray(GLuint id)
+{
+	if (change(vertexArray == id))
+		glBindVertexArray(vertexArray = id);
+}
+
+inline void GLState::bindTexture(GLuint unit, GLuint texture)
+{
+	if (unit >= MAX_TEXTURE_UNITS) {
+		glActiveTexture(GL_TEXTURE0 + unit);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		activeUnit = unit;
+		return;
+	}
+	if (!change(textures[unit] == texture))
+		return;
+	if (change(activeUnit == unit))
+		glActiveTexture(GL_TEXTURE0 + (activeUnit = unit));
+	glBindTexture(GL_TEXTURE_2D, textures[unit] = texture);
+}
+
+inline void GLState::setViewport(const Viewport& viewport)
+{
+	if (change(viewKnown && view == viewport)) {
+		view = viewport;
+		viewKnown = true;
+		glViewport(view.x, view.y, view.width, view.height);
+	}
+}
+
+inline void GLState::setEnabled(GLenum capability, bool enabled)
+{
+	auto it = capabilities.find(capability);
+	if (change(it != capabilities.end() && it->second == enabled)) {
+		capabilities[capability] = enabled;
+		if (enabled)
+			glEnable(capability);
+		else
+			glDisable(capability);
+	}
+}
+
+inline void GLState::cullFace(GLenum mode)
+{
+	if (change(cullMode == mode))
+		glCullFace(cullMode = mode);
+}
+
+inline void GLState::blendFunc(GLenum source, GLenum destination)
+{
+	if (change(blendSource == source && blendDestination == destination))
+		glBlendFunc(blendSource = source, blendDestination = destination);
+}
+
+inline void GLState::depthFunc(GLenum func)
+{
+	if (change(depthFunction == func))
+		glDepthFunc(depthFunction = func);
+}
+
+inline void GLState::depthMask(bool write)
+{
+	if (change(depthWrite == int(write))) {
+		depthWrite = write;
+		glDepthMask(write ? GL_TRUE : GL_FALSE);
+	}
+}
+
+inline const GLState::Viewport& GLState::viewport()
+{
+	if (!viewKnown) {
+		GLint v[4];
+		glGetIntegerv(GL_VIEWPORT, v);
+		view = { v[0], v[1], v[2], v[3] };
+		viewKnown = true;
+	}
+	return view;
+}
+
+inline bool GLState::isEnabled(GLenum capability)
+{
+	auto it = capabilities.find(capability);
+	if (it == capabilities.end())
+		it = capabilities.emplace(capability, glIsEnabled(capability) == GL_TRUE).first;
+	return it->second;
+}
+
+inline void GLState::forgetTexture(GLuint texture)
+{
+	for (GLuint& bound : textures) {
+		if (bound == texture)
+			bound = 0;
+	}
+}
+
+inline void GLState::forgetVertexArray(GLuint id)
+{
+	if (vertexArray == id)
+		vertexArray = 0;
+}
+
+inline void GLState::invalidate()
+{
+	program = UNKNOWN;
+	vertexArray = UNKNOWN;
+	activeUnit = UNKNOWN;
+	for (GLuint& bound : textures)
+		bound = UNKNOWN;
+	viewKnown = false;
+	capabilities.clear();
+	cullMode = depthFunction = UNKNOWN;
+	blendSource = blendDestination = UNKNOWN;
+	depthWrite = -1;
+}
+
+inline GLState::Stats GLState::takeStats()
+{
+	Stats result = stats;
+	stats = {};
+	return result;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <span>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "gl_handle.h"
+
+// Per-instance vertex attributes for shaders compiled with INSTANCED (see
+// ShaderFeatures::instanced). They replace the "model" uniform; the tint
+// scales the material's diffuse and emissive colours.
+struct InstanceData
+{
+	// Attribute locations: a mat4 takes four, a mat3 three
+	static constexpr GLuint MODEL_LOCATION = 3;
+	static constexpr GLuint NORMAL_LOCATION = 7;
+	static constexpr GLuint TINT_LOCATION = 10;
+
+	InstanceData(const glm::mat4& model = glm::mat4(1.0f), const glm::vec4& tint = glm::vec4(1.0f))
+		: model(model), normal(glm::transpose(glm::inverse(glm::mat3(model)))), tint(tint) {}
+
+	glm::mat4 model;
+	glm::mat3 normal;
+	glm::vec4 tint;
+};
+
+// A stream of InstanceData for the vertex array it is attached to, refilled
+// for every instanced draw
+class InstanceBuffer
+{
+public:
+	void upload(std::span<const InstanceData> instances);
+	// Points the bound VAO's instance attributes at the buffer, the first
+	// time only; VAOs keep them
+	void attach();
+
+private:
+	BufferHandle buffer;
+	size_t capacity = 0; // in instances
+	bool attached = false;
+};
+
+inline void InstanceBuffer::upload(std::span<const InstanceData> instances)
+{
+	if (!buffer)
+		buffer = createBuffer();
+	glBindBuffer(GL_ARRAY_BUFFER, buffer.get());
+	// Reallocating orphans the storage earlier draws still read, so the
+	// driver doesn't have to wait for them
+	capacity = std::max(instances.size(), capacity);
+	glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(InstanceData), nullptr, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, instances.size_bytes(), instances.data());
+}
+
+inline void InstanceBuffer::attach()
+{
+	if (attached)
+		return;
+	attached = true;
+	glBindBuffer(GL_ARRAY_BUFFER, buffer.get());
+	GLsizei stride = sizeof(InstanceData);
+	auto attribute = [&](GLuint location, GLint size, size_t offset) {
+		glEnableVertexAttribArray(location);
+		glVertexAttribPointer(location, size, GL_FLOAT, GL_FALSE, stride,
+			reinterpret_cast<void*>(offset));
+		glVertexAttribDivisor(location, 1);
+	};
+	for (GLuint i = 0; i < 4; i++)
+		attribute(InstanceData::MODEL_LOCATION + i, 4, offsetof(InstanceData, model) + i * sizeof(glm::vec4));
+	for (GLuint i = 0; i < 3; i++)
+		attribute(InstanceData::NORMAL_LOCATION + i, 3, offsetof(InstanceData, normal) + i * sizeof(glm::vec3));
+	attribute(InstanceData::TINT_LOCATION, 4, offsetof(InstanceData, tint));
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstddef>
+#include <iostream>
+
 #include <glm/glm.hpp>
 #include "shader.h"
 
@@ -9,8 +12,6 @@ struct DirLight {
 	glm::vec3 ambient;
 	glm::vec3 diffuse;
 	glm::vec3 specular;
-
-	void apply(const Shader& shader, const std::string& name);
 };
 
 struct PointLight {
@@ -23,8 +24,6 @@ struct PointLight {
 	glm::vec3 ambient;
 	glm::vec3 diffuse;
 	glm::vec3 specular;
-
-	void apply(const Shader& shader, const std::string& name);
 };
 
 struct SpotLight {
@@ -40,37 +39,97 @@ struct SpotLight {
 	glm::vec3 ambient;
 	glm::vec3 diffuse;
 	glm::vec3 specular;
+};
 
-	void apply(const Shader& shader, const std::string& name);
+// std140 layouts of the lights, as in the Lights block of the shaders
+namespace std140 {
+
+struct DirLight {
+	alignas(16) glm::vec3 direction;
+	alignas(16) glm::vec3 ambient;
+	alignas(16) glm::vec3 diffuse;
+	alignas(16) glm::vec3 specular;
 };
 
-void DirLight::apply(const Shader& shader, const std::string& name) {
-	shader.setVec3(name + ".direction", direction);
-	shader.setVec3(name + ".ambient", ambient);
-	shader.setVec3(name + ".diffuse", diffuse);
-	shader.setVec3(name + ".specular", specular);
+struct PointLight {
+	alignas(16) glm::vec3 position;
+	float constant;
+	float linear;
+	float quadratic;
+	alignas(16) glm::vec3 ambient;
+	alignas(16) glm::vec3 diffuse;
+	alignas(16) glm::vec3 specular;
+};
+
+struct SpotLight {
+	alignas(16) glm::vec3 position;
+	alignas(16) glm::vec3 direction;
+	float innerCutoff;
+	float outerCutoff;
+	float constant;
+	float linear;
+	float quadratic;
+	alignas(16) glm::vec3 ambient;
+	alignas(16) glm::vec3 diffuse;
+	alignas(16) glm::vec3 specular;
+};
+
+static_assert(sizeof(DirLight) == 64);
+static_assert(sizeof(PointLight) == 80 && offsetof(PointLight, ambient) == 32);
+static_assert(sizeof(SpotLight) == 96 && offsetof(SpotLight, ambient) == 48);
+
 }
 
-void PointLight::apply(const Shader& shader, const std::string& name) {
-	shader.setVec3(name + ".position", position);
-	shader.setFloat(name + ".constant", constant);
-	shader.setFloat(name + ".linear", linear);
-	shader.setFloat(name + ".quadratic", quadratic);
-	shader.setVec3(name + ".ambient", ambient);
-	shader.setVec3(name + ".diffuse", diffuse);
-	shader.setVec3(name + ".specular", specular);
+// Contents of the Lights uniform block, see UniformBuffer
+struct LightsBlock
+{
+	static constexpr GLuint BINDING = uniform_blocks::LIGHTS;
+	// MAX_LIGHTS in the shaders
+	static constexpr int MAX_LIGHTS = 10;
+
+	int numDirLights = 0;
+	int numPointLights = 0;
+	int numSpotLights = 0;
+	alignas(16) std140::DirLight dirLights[MAX_LIGHTS];
+	std140::PointLight pointLights[MAX_LIGHTS];
+	std140::SpotLight spotLights[MAX_LIGHTS];
+
+	void clear() { numDirLights = numPointLights = numSpotLights = 0; }
+	bool add(const DirLight& light);
+	bool add(const PointLight& light);
+	bool add(const SpotLight& light);
+};
+
+static_assert(offsetof(LightsBlock, dirLights) == 16);
+
+inline bool LightsBlock::add(const DirLight& l)
+{
+	if (numDirLights == MAX_LIGHTS) {
+		std::cerr << "ERROR::LIGHTS::TOO_MANY_DIR_LIGHTS" << std::endl;
+		return false;
+	}
+	dirLights[numDirLights++] = { l.direction, l.ambient, l.diffuse, l.specular };
+	return true;
 }
 
-void SpotLight::apply(const Shader& shader, const std::string& name) {
-	shader.setVec3(name + ".position", position);
-	shader.setVec3(name + ".direction", direction);
-	shader.setFloat(name + ".innerCutoff", innerCutoff);
-	shader.setFloat(name + ".outerCutoff", outerCutoff);
-	shader.setFloat(name + ".constant", constant);
-	shader.setFloat(name + ".linear", linear);
-	shader.setFloat(name + ".quadratic", quadratic);
-	shader.setVec3(name + ".ambient", ambient);
-	shader.setVec3(name + ".diffuse", diffuse);
-	shader.setVec3(name + ".specular", specular);
+inline bool LightsBlock::add(const PointLight& l)
+{
+	if (numPointLights == MAX_LIGHTS) {
+		std::cerr << "ERROR::LIGHTS::TOO_MANY_POINT_LIGHTS" << std::endl;
+		return false;
+	}
+	pointLights[numPointLights++] = { l.position, l.constant, l.linear, l.quadratic,
+		l.ambient, l.diffuse, l.specular };
+	return true;
 }
 
+inline bool LightsBlock::add(const SpotLight& l)
+{
+	if (numSpotLights == MAX_LIGHTS) {
+		std::cerr << "ERROR::LIGHTS::TOO_MANY_SPOT_LIGHTS" << std::endl;
+		return false;
+	}
+	spotLights[numSpotLights++] = { l.position, l.direction, l.innerCutoff, l.outerCutoff,
+		l.constant, l.linear, l.quadratic, l.ambient, l.diffuse, l.specular };
+	return true;
+}
@@ -2,6 +2,8 @@
 #include <cmath>
 #include <algorithm>
 #include <filesystem>
+#include <chrono>
+#include <string>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
@@ -9,13 +11,17 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
-#include <fmt/format.h>
 
 #include "camera.h"
+#include "gl_state.h"
 #include "shader.h"
+#include "shader_permutations.h"
 #include "model.h"
+#include "model_loader.h"
 #include "lights.h"
+#include "uniform_buffer.h"
 #include "primitives.h"
+#include "render_queue.h"
 #include "utils.h"
 #include "debug.h"
 
@@ -28,6 +34,7 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 void mouseCallback(GLFWwindow* window, double xpos, double ypos);
 void scrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void framebufferSizeCallback(GLFWwindow* window, int width, int height);
+void benchmarkLoaders(const fs::path& path, int runs = 10);
 
 // settings
 const unsigned int SCR_WIDTH = 800;
@@ -42,12 +49,27 @@ double lastX = SCR_WIDTH / 2.0f;
 double lastY = SCR_HEIGHT / 2.0f;
 bool firstMouse = true;
 
+// B toggles drawing the streamed model with one multi-draw per material,
+// instead of culled per-mesh draws through the render queue
+bool batchModels = false;
+
 // timing
 float deltaTime = 0.0f;	// time between current frame and last frame
 float lastTime = 0.0f;
 
 int main()
 {
+#ifdef BENCHMARK_LOADERS
+	// compare the native OBJ loader with Assimp; needs no window
+	benchmarkLoaders("../Resources/models/nanosuit/nanosuit.obj");
+	return 0;
+#endif
+
+	// workers of the shared pool post to the main thread queue, so the queue
+	// must outlive the pool: statics are destroyed in reverse order
+	MainThreadQueue::shared();
+	ThreadPool::shared();
+
 	// glfw: initialize and configure
 	// ------------------------------
 	glfwInit();
@@ -86,124 +108,205 @@ int main()
 
 	// configure global opengl state
 	// -----------------------------
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
-	glCullFace(GL_BACK);
+	GLState& gl = GLState::shared();
+	gl.enable(GL_DEPTH_TEST);
+	gl.enable(GL_CULL_FACE);
+	gl.cullFace(GL_BACK);
 	//glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
-	// build and compile our shader program
-	// ------------------------------------
-	Shader shader("shaders/shader.vert", "shaders/shader.frag");
-
-	// Load mesh
-	// ---------
-
-	Mesh model1 = makeSphere();
-	//Mesh model1 = makeCube(true);
-	Material matl;
-	matl.ambient_color = vec3(1.0f);
-	matl.diffuse_color = vec3(1.0f);
-	matl.specular_color = vec3(0.5f);
-	matl.shininess = 10.0f;
-	matl.diffuse_texture = Texture("../Resources/textures/earth_sphere10k.jpg");
-	//matl.diffuse_texture = Texture("../Resources/textures/cubenet.png");
-	model1.material = &matl;
-
-	Mesh lightMesh = makeSphere();
-	Material lightMatl;
-	lightMatl.diffuse_color = vec3(0.0f);
-	lightMatl.specular_color = vec3(0.0f);
-	lightMatl.ambient_color = vec3(0.0f);
-	lightMatl.emissive_color = vec3(1.0f);
-	lightMesh.material = &lightMatl;
-
-	PointLight pointLights[] = {
-		{
-			.position = {1.0f, 1.0f, 1.0f},
-			.constant = 1.0f,
-			.linear = 0.09f,
-			.quadratic = 0.032f,
-			.ambient = vec3(0.2f),
-			.diffuse = vec3(1.0f),
-			.specular = vec3(1.0f),
-		},
-		{
-			.position = {1.0f, 1.0f, 1.0f},
-			.constant = 1.0f,
-			.linear = 0.09f,
-			.quadratic = 0.032f,
-			.ambient = vec3(0.2f),
-			.diffuse = vec3(1.0f),
-			.specular = vec3(1.0f),
-		},
-	};
-
-	// render loop
-	// -----------
-	while (!glfwWindowShouldClose(window))
+	// GL objects release themselves on destruction, so they are scoped to
+	// make sure that happens while the context still exists
 	{
-		// per-frame time logic
-		// --------------------
-		float currentTime = float(glfwGetTime());
-		deltaTime = currentTime - lastTime;
-		lastTime = currentTime;
-
-		// input
-		// -----
-		processInput(window);
-
-		// render
-		// ------
-		glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-		shader.use();
-		shader.setVec3("viewPos", camera.Position);
-
-		//vec3 lightColor(1.0);
-		vec3 lightColor = glm::clamp(glm::sin(currentTime * vec3(2.0f, 0.7f, 1.3f)), 0.0f, 1.0f) * 1.5f;
-		pointLights[1].ambient = 0.2f * lightColor;
-		pointLights[1].diffuse = pointLights[1].specular = lightColor;
-
-		float r = 2.0f, t = currentTime * 0.5f;
-		pointLights[0].position = { r * glm::cos(t), 0.0f, r * glm::sin(t) };
-
-		shader.setInt("numDirLights", 0);
-		shader.setInt("numPointLights", int(std::size(pointLights)));
-		for (int i = 0; i < std::size(pointLights); i++) {
-			pointLights[i].apply(shader, fmt::format("pointLights[{}]", i));
-		}
-		shader.setInt("numSpotLights", 0);
-
-		// view/projection transformations
-		auto [_x, _y, width, height] = util::glGet<int, 4>(GL_VIEWPORT);
-		float aspect = float(width) / float(height);
-		glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), aspect, ZNEAR, ZFAR);
-		shader.setMat4("projection", projection);
-		shader.setMat4("view", camera.GetViewMatrix());
-
-		// render the loaded model
-		glm::mat4 modelMat = glm::mat4(1.0f);
-		modelMat = glm::rotate(modelMat, currentTime * .2f, { 0.0f, 1.0f, 0.0f });
-		//modelMat = glm::translate(modelMat, { 0.0f, -1.75f, 0.0f }); // translate it down so it's at the center of the scene
-		//modelMat = glm::scale(modelMat, vec3(0.2f));	// it's a bit too big for our scene, so scale it down
-		shader.setMat4("model", modelMat);
-
-		model1.draw(shader);
-
-		for (PointLight& light : pointLights) {
+		// our shader programs, one permutation per material texture set and
+		// light count; they compile in the background as they're requested
+		// ------------------------------------
+		ShaderPermutations shaders("shaders/shader.vert", "shaders/shader.frag");
+		ShaderBatch shaderBatch;
+		// camera and lights, written once per frame for all shaders
+		UniformBuffer<FrameBlock> frameUniforms;
+		UniformBuffer<LightsBlock> lightUniforms;
+		LightsBlock lights;
+		// draws sorted to share programs, materials and VAOs
+		RenderQueue renderQueue;
+
+		// Load mesh
+		// ---------
+
+		Mesh model1 = makeSphere();
+		//Mesh model1 = makeCube(true);
+		Material matl;
+		matl.ambient_color = vec3(1.0f);
+		matl.diffuse_color = vec3(1.0f);
+		matl.specular_color = vec3(0.5f);
+		matl.shininess = 10.0f;
+		matl.diffuse_texture = Texture("../Resources/textures/earth_sphere10k.jpg");
+		//matl.diffuse_texture = Texture("../Resources/textures/cubenet.png");
+		matl.compile();
+		model1.material = &matl;
+
+		Mesh lightMesh = makeSphere();
+		Material lightMatl;
+		lightMatl.diffuse_color = vec3(0.0f);
+		lightMatl.specular_color = vec3(0.0f);
+		lightMatl.ambient_color = vec3(0.0f);
+		lightMatl.emissive_color = vec3(1.0f);
+		lightMatl.compile();
+		lightMesh.material = &lightMatl;
+
+		// Stream a model in the background, drawing a placeholder until it's ready
+		std::stop_source stopLoading;
+		Task<std::unique_ptr<Model>> nanosuitTask =
+			loadModel("../Resources/models/nanosuit/nanosuit.obj",
+				{ .vertexFormat = VertexFormat::compact(),
+				  .residency = GeometryResidency::Paged },
+				2, stopLoading.get_token());
+		nanosuitTask.start();
+		std::unique_ptr<Model> nanosuit;
+		Mesh placeholderMesh = makeSphere(8, 16);
+		Material placeholderMatl;
+		placeholderMatl.diffuse_color = vec3(0.5f);
+		placeholderMatl.compile();
+		placeholderMesh.material = &placeholderMatl;
+
+		PointLight pointLights[] = {
+			{
+				.position = {1.0f, 1.0f, 1.0f},
+				.constant = 1.0f,
+				.linear = 0.09f,
+				.quadratic = 0.032f,
+				.ambient = vec3(0.2f),
+				.diffuse = vec3(1.0f),
+				.specular = vec3(1.0f),
+			},
+			{
+				.position = {1.0f, 1.0f, 1.0f},
+				.constant = 1.0f,
+				.linear = 0.09f,
+				.quadratic = 0.032f,
+				.ambient = vec3(0.2f),
+				.diffuse = vec3(1.0f),
+				.specular = vec3(1.0f),
+			},
+		};
+		// the light spheres are instances of one mesh, tinted by their light
+		std::vector<InstanceData> lightInstances;
+		ShaderFeatures instancedLights{ .numPointLights = int(std::size(pointLights)), .instanced = true };
+
+		// the permutations drawn below, so they compile together
+		ShaderFeatures lightFeatures{ .numPointLights = int(std::size(pointLights)) };
+		for (const Material* material : { &matl, &placeholderMatl })
+			shaderBatch.add(material->selectShader(shaders, lightFeatures));
+		shaderBatch.add(lightMatl.selectShader(shaders, instancedLights));
+		shaderBatch.finish();
+
+		// render loop
+		// -----------
+		while (!glfwWindowShouldClose(window))
+		{
+			// per-frame time logic
+			// --------------------
+			float currentTime = float(glfwGetTime());
+			deltaTime = currentTime - lastTime;
+			lastTime = currentTime;
+
+			// input
+			// -----
+			processInput(window);
+
+			// finish pending async work, such as model uploads
+			MainThreadQueue::shared().poll();
+			if (nanosuitTask.done()) {
+				// a failed load returns nullptr and keeps the placeholder
+				nanosuit = nanosuitTask.result();
+				nanosuitTask = {};
+			}
+			// material uniforms are tracked per frame
+			MaterialTracker::shared().reset();
+
+			// render
+			// ------
+			glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+			//vec3 lightColor(1.0);
+			vec3 lightColor = glm::clamp(glm::sin(currentTime * vec3(2.0f, 0.7f, 1.3f)), 0.0f, 1.0f) * 1.5f;
+			pointLights[1].ambient = 0.2f * lightColor;
+			pointLights[1].diffuse = pointLights[1].specular = lightColor;
+
+			float r = 2.0f, t = currentTime * 0.5f;
+			pointLights[0].position = { r * glm::cos(t), 0.0f, r * glm::sin(t) };
+
+			lights.clear();
+			for (const PointLight& light : pointLights)
+				lights.add(light);
+			lightUniforms.update(lights);
+			ShaderFeatures features = ShaderFeatures::forLights(lights);
+
+			// view/projection transformations
+			auto [_x, _y, width, height] = gl.viewport();
+			float aspect = float(width) / float(height);
+			glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), aspect, ZNEAR, ZFAR);
+			glm::mat4 view = camera.GetViewMatrix();
+			frameUniforms.update({ projection, view, camera.Position });
+			renderQueue.begin(projection, view, camera.Position);
+
+			// render the loaded model
 			glm::mat4 modelMat = glm::mat4(1.0f);
-			modelMat = glm::translate(modelMat, light.position);
-			modelMat = glm::scale(modelMat, vec3(0.1f));
-			shader.setMat4("model", modelMat);
-			lightMatl.emissive_color = light.diffuse;
-			lightMesh.draw(shader);
+			modelMat = glm::rotate(modelMat, currentTime * .2f, { 0.0f, 1.0f, 0.0f });
+			//modelMat = glm::translate(modelMat, { 0.0f, -1.75f, 0.0f }); // translate it down so it's at the center of the scene
+			//modelMat = glm::scale(modelMat, vec3(0.2f));	// it's a bit too big for our scene, so scale it down
+			renderQueue.submit(model1, matl.selectShader(shaders, features), modelMat);
+
+			lightInstances.clear();
+			for (PointLight& light : pointLights) {
+				glm::mat4 modelMat = glm::mat4(1.0f);
+				modelMat = glm::translate(modelMat, light.position);
+				modelMat = glm::scale(modelMat, vec3(0.1f));
+				lightInstances.emplace_back(modelMat, glm::vec4(light.diffuse, 1.0f));
+			}
+			ShaderFeatures instanced = features;
+			instanced.instanced = true;
+			renderQueue.submit({ .mesh = &lightMesh, .shader = &lightMatl.selectShader(shaders, instanced),
+				.material = &lightMatl, .instances = lightInstances });
+
+			modelMat = glm::mat4(1.0f);
+			modelMat = glm::translate(modelMat, { 3.0f, -1.5f, 0.0f });
+			if (nanosuit) {
+				modelMat = glm::scale(modelMat, vec3(0.2f));
+				if (batchModels) {
+					nanosuit->drawBatched(shaders, features, modelMat);
+				}
+				else {
+					LodSelector lodSelector{ .cameraPosition = camera.Position,
+						.projectionScale = LodSelector::perspectiveScale(glm::radians(camera.Zoom), float(height)) };
+					renderQueue.submit(*nanosuit, shaders, features, lodSelector, modelMat);
+				}
+			}
+			else {
+				modelMat = glm::translate(modelMat, { 0.0f, 1.5f, 0.0f });
+				modelMat = glm::scale(modelMat, vec3(0.5f));
+				renderQueue.submit(placeholderMesh, placeholderMatl.selectShader(shaders, features), modelMat);
+			}
+			renderQueue.flush();
+
+			// glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
+			// -------------------------------------------------------------------------------
+			glfwSwapBuffers(window);
+			glfwPollEvents();
+
+			// show how many state changes the GLState mirror saved this frame
+			GLState::Stats glStats = gl.takeStats();
+			if (int(currentTime) != int(currentTime - deltaTime)) {
+				std::string title = "LearnOpenGL - " + std::to_string(glStats.elided) + " of "
+					+ std::to_string(glStats.issued + glStats.elided) + " GL state calls elided";
+				glfwSetWindowTitle(window, title.c_str());
+			}
 		}
 
-		// glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-		// -------------------------------------------------------------------------------
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+		// a load still in flight uses the pool and the GL; cancel it and let
+		// it wind down while the context exists
+		stopLoading.request_stop();
+		MainThreadQueue::shared().drain(nanosuitTask);
 	}
 
 	// glfw: terminate, clearing all previously allocated GLFW resources.
@@ -241,6 +344,8 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 {
 	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
 		glfwSetWindowShouldClose(window, true);
+	if (key == GLFW_KEY_B && action == GLFW_PRESS)
+		batchModels = !batchModels;
 }
 
 // glfw: whenever the mouse moves, this callback is called
@@ -280,5 +385,40 @@ void framebufferSizeCallback(GLFWwindow* window, int width, int height)
 	// make sure the viewport matches the new window dimensions; note that width and
 	// height will be significantly larger than specified on retina displays.
 	if (width > 0 && height > 0)
-		glViewport(0, 0, width, height);
+		GLState::shared().setViewport(0, 0, width, height);
+}
+
+// time importing a model with Assimp and with the native OBJ loader
+// -----------------------------------------------------------------
+void benchmarkLoaders(const fs::path& path, int runs)
+{
+	using clock = std::chrono::steady_clock;
+	auto timeRuns = [&](auto&& load) {
+		double best = 1e30;
+		for (int i = 0; i < runs; i++) {
+			ModelData data;
+			auto start = clock::now();
+			if (!load(data)) {
+				std::cerr << "Failed to load " << path << std::endl;
+				return 0.0;
+			}
+			best = std::min(best, std::chrono::duration<double, std::milli>(clock::now() - start).count());
+		}
+		return best;
+	};
+	double assimpTime = timeRuns([&](ModelData& data) { return Model::importAssimp(path, data); });
+	double nativeTime = timeRuns([&](ModelData& data) { return obj_loader::load(path, data); });
+	std::cout << path << " (best of " << runs << ", " << ThreadPool::shared().size() << " threads)\n";
+	std::cout << "Assimp:     " << assimpTime << " ms\n";
+	std::cout << "OBJ loader: " << nativeTime << " ms\n";
+	if (nativeTime > 0.0)
+		std::cout << "Speedup:    " << assimpTime / nativeTime << "x" << std::endl;
+
+	ModelData data;
+	if (Model::importData(path, data)) {
+		auto start = clock::now();
+		mesh_optimizer::Report report = mesh_optimizer::optimize(data);
+		double optimizeTime = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+		std::cout << "Optimized:  " << report << " in " << optimizeTime << " ms" << std::endl;
+	}
 }
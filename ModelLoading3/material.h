@@ -1,6 +1,9 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <iostream>
+#include <unordered_map>
 #include <string>
 #include <filesystem>
 
@@ -8,8 +11,11 @@
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 
+#include "gl_state.h"
 #include "shader.h"
+#include "shader_permutations.h"
 #include "texture.h"
+#include "texture_loader.h"
 #include "u8tils.h"
 
 namespace fs = std::filesystem;
@@ -18,17 +24,73 @@ std::ostream& operator<<(std::ostream& os, const glm::vec2& vec);
 std::ostream& operator<<(std::ostream& os, const glm::vec3& vec);
 std::ostream& operator<<(std::ostream& os, const glm::vec4& vec);
 
+// CPU-side material description, as imported or read back from the model cache
+struct MaterialData {
+	MaterialData() {}
+	MaterialData(aiMaterial* mat, const fs::path& directory);
+	static fs::path resolveTexture(const fs::path& directory, std::string_view filename);
+
+	std::string name;
+	float shininess = 0.0f;
+	glm::vec3 diffuse_color = { 1.0f, 1.0f, 1.0f };
+	glm::vec3 specular_color = { 0.0f, 0.0f, 0.0f };
+	glm::vec3 ambient_color = { 1.0f, 1.0f, 1.0f };
+	glm::vec3 emissive_color = { 0.0f, 0.0f, 0.0f };
+	fs::path diffuse_texture;
+	fs::path specular_texture;
+	fs::path ambient_texture;
+	fs::path emissive_texture;
+	fs::path ao_texture;
+	fs::path normal_texture;
+private:
+	static void getColor(aiMaterial* mat, const char* pKey,
+		unsigned int type, unsigned int index, glm::vec3& out);
+	static fs::path getTexture(aiMaterial* mat, const fs::path& directory,
+		aiTextureType type, unsigned int index = 0);
+};
+
 class Material {
 public:
-	explicit Material(std::string_view name = "") : name(name) {}
-	Material(aiMaterial* mat, const fs::path& directory);
+	// Textures go to units 0 to TEXTURE_UNITS - 1, in the order declared below
+	static constexpr int TEXTURE_UNITS = 6;
+	static constexpr Uniform TEXTURE_NAMES[TEXTURE_UNITS] = {
+		"material.diffuse_texture", "material.specular_texture", "material.ambient_texture",
+		"material.emissive_texture", "material.ao_texture", "material.normal_texture",
+	};
+
+	// A material compiled to what the shaders see of it. Equal blocks need no
+	// uniform or texture changes between draws.
+	struct Block {
+		float shininess = 0.0f;
+		glm::vec3 diffuse_color{}, specular_color{}, ambient_color{}, emissive_color{};
+		GLuint textures[TEXTURE_UNITS] = {};
+		bool operator==(const Block&) const = default;
+	};
+
+	explicit Material(std::string_view name = "") : name(name) { compile(); }
+	// With a loader, textures are decoded in the background and only valid
+	// after loader->finish()
+	explicit Material(const MaterialData& data, TextureLoader* loader = nullptr);
+	Material(aiMaterial* mat, const fs::path& directory)
+		: Material(MaterialData(mat, directory)) {}
 	void apply(const Shader& shader) const;
+	// Rebuilds the block MaterialTracker applies. Materials compile when they
+	// are built; call it again after changing the properties below, or once
+	// textures from a TextureLoader are uploaded.
+	void compile();
+	const Block& compiled() const { return block; }
+	// Changes with every compile(), and differs between materials
+	uint64_t version() const { return version_; }
+	// The bound textures the shaders use, as ShaderFeatures texture bits
+	uint32_t textureSet() const;
+	// The permutation specialized for this material's textures and the lights
+	const Shader& selectShader(ShaderPermutations& shaders, const ShaderFeatures& lights) const;
 	friend std::ostream& operator<<(std::ostream& os, const Material& mat);
 private:
-	static void getColor(aiMaterial* mat, const char* pKey,
-		unsigned int type, unsigned int index, glm::vec3& out);
-	static Texture getTexture(aiMaterial* mat, const fs::path& directory,
-		aiTextureType type, unsigned int index = 0);
+	static void getTexture(const fs::path& path, TextureLoader* loader, Texture& out);
+
+	Block block;
+	uint64_t version_ = 0;
 public:
 	// Material properties
 	std::string name;
@@ -45,8 +107,44 @@ public:
 	Texture normal_texture;
 };
 
+// Applies compiled materials without repeating the material uniforms each
+// program last received, or the textures last bound. Applying the material a
+// program already has returns at once, and a changed material only sets what
+// changed. Uniform locations are resolved once per program. reset() at the
+// start of every frame, since program names are reused, and after setting
+// material uniforms or binding textures elsewhere.
+class MaterialTracker
+{
+public:
+	MaterialTracker() { reset(); }
+	static MaterialTracker& shared();
+
+	// shader must be the program in use
+	void apply(const Shader& shader, const Material& material);
+	void reset();
+
+private:
+	// A compiled material, as last applied
+	struct Applied {
+		const Material* material = nullptr;
+		uint64_t version = 0;
+		bool is(const Material& m) const { return material == &m && version == m.version(); }
+	};
+	struct Bindings {
+		GLint shininess, diffuse_color, specular_color, ambient_color, emissive_color;
+		GLint bound[Material::TEXTURE_UNITS];
+		Applied applied;
+		Material::Block block;
+	};
+	Bindings& bindings(const Shader& shader);
+
+	std::unordered_map<GLuint, Bindings> programs;
+	// Texture units are shared by all programs
+	Applied textures;
+};
 
-inline Material::Material(aiMaterial* mat, const fs::path& directory) {
+
+inline MaterialData::MaterialData(aiMaterial* mat, const fs::path& directory) {
 	aiString aiName;
 	mat->Get(AI_MATKEY_NAME, aiName);
 	name = aiName.C_Str();
@@ -67,6 +165,23 @@ inline Material::Material(aiMaterial* mat, const fs::path& directory) {
 	normal_texture = getTexture(mat, directory, aiTextureType_NORMALS);
 }
 
+inline Material::Material(const MaterialData& data, TextureLoader* loader) :
+	name(data.name),
+	shininess(data.shininess),
+	diffuse_color(data.diffuse_color),
+	specular_color(data.specular_color),
+	ambient_color(data.ambient_color),
+	emissive_color(data.emissive_color)
+{
+	getTexture(data.diffuse_texture, loader, diffuse_texture);
+	getTexture(data.specular_texture, loader, specular_texture);
+	getTexture(data.ambient_texture, loader, ambient_texture);
+	getTexture(data.emissive_texture, loader, emissive_texture);
+	getTexture(data.ao_texture, loader, ao_texture);
+	getTexture(data.normal_texture, loader, normal_texture);
+	compile();
+}
+
 inline void Material::apply(const Shader& shader) const {
 	shader.setFloat("material.shininess", shininess);
 	shader.setVec3("material.diffuse_color", diffuse_color);
@@ -82,7 +197,102 @@ inline void Material::apply(const Shader& shader) const {
 	normal_texture.apply(shader, "material.normal_texture", 5);
 }
 
-inline void Material::getColor(aiMaterial* mat, const char* pKey,
+inline void Material::compile() {
+	static std::atomic<uint64_t> versions = 0;
+	version_ = ++versions;
+	block.shininess = shininess;
+	block.diffuse_color = diffuse_color;
+	block.specular_color = specular_color;
+	block.ambient_color = ambient_color;
+	block.emissive_color = emissive_color;
+	const Texture* textures[TEXTURE_UNITS] = { &diffuse_texture, &specular_texture,
+		&ambient_texture, &emissive_texture, &ao_texture, &normal_texture };
+	for (int i = 0; i < TEXTURE_UNITS; i++)
+		block.textures[i] = textures[i]->id();
+}
+
+inline MaterialTracker& MaterialTracker::shared() {
+	static MaterialTracker tracker;
+	return tracker;
+}
+
+inline void MaterialTracker::reset() {
+	programs.clear();
+	textures = {};
+}
+
+inline MaterialTracker::Bindings& MaterialTracker::bindings(const Shader& shader) {
+	auto [it, inserted] = programs.try_emplace(shader.id());
+	Bindings& b = it->second;
+	if (inserted) {
+		b.shininess = shader.location("material.shininess");
+		b.diffuse_color = shader.location("material.diffuse_color");
+		b.specular_color = shader.location("material.specular_color");
+		b.ambient_color = shader.location("material.ambient_color");
+		b.emissive_color = shader.location("material.emissive_color");
+		for (int i = 0; i < Material::TEXTURE_UNITS; i++) {
+			// samplers always read the same unit
+			shader.setInt(Material::TEXTURE_NAMES[i].field("texture"), i);
+			b.bound[i] = shader.location(Material::TEXTURE_NAMES[i].field("bound"));
+		}
+	}
+	return b;
+}
+
+inline void MaterialTracker::apply(const Shader& shader, const Material& material) {
+	Bindings& b = bindings(shader);
+	bool uniformsSet = b.applied.is(material);
+	if (uniformsSet && textures.is(material))
+		return;
+	const Material::Block& block = material.compiled();
+	if (!uniformsSet) {
+		const Material::Block* last = b.applied.material ? &b.block : nullptr;
+		if (!last || block.shininess != last->shininess)
+			glUniform1f(b.shininess, block.shininess);
+		if (!last || block.diffuse_color != last->diffuse_color)
+			glUniform3fv(b.diffuse_color, 1, &block.diffuse_color[0]);
+		if (!last || block.specular_color != last->specular_color)
+			glUniform3fv(b.specular_color, 1, &block.specular_color[0]);
+		if (!last || block.ambient_color != last->ambient_color)
+			glUniform3fv(b.ambient_color, 1, &block.ambient_color[0]);
+		if (!last || block.emissive_color != last->emissive_color)
+			glUniform3fv(b.emissive_color, 1, &block.emissive_color[0]);
+		for (int i = 0; i < Material::TEXTURE_UNITS; i++) {
+			bool bound = block.textures[i] != 0;
+			if (!last || bound != (last->textures[i] != 0))
+				glUniform1i(b.bound[i], bound);
+		}
+		b.block = block;
+		b.applied = { &material, material.version() };
+	}
+	if (!textures.is(material)) {
+		for (int i = 0; i < Material::TEXTURE_UNITS; i++)
+			GLState::shared().bindTexture(i, block.textures[i]);
+		textures = { &material, material.version() };
+	}
+}
+
+inline uint32_t Material::textureSet() const {
+	uint32_t set = 0;
+	if (!diffuse_texture.empty())
+		set |= ShaderFeatures::DIFFUSE_TEXTURE;
+	if (!specular_texture.empty())
+		set |= ShaderFeatures::SPECULAR_TEXTURE;
+	if (!emissive_texture.empty())
+		set |= ShaderFeatures::EMISSIVE_TEXTURE;
+	if (!ao_texture.empty())
+		set |= ShaderFeatures::AO_TEXTURE;
+	return set;
+}
+
+inline const Shader& Material::selectShader(ShaderPermutations& shaders,
+		const ShaderFeatures& lights) const {
+	ShaderFeatures features = lights;
+	features.textures = textureSet();
+	return shaders.get(features);
+}
+
+inline void MaterialData::getColor(aiMaterial* mat, const char* pKey,
 		unsigned int type, unsigned int index, glm::vec3& out) {
 	aiColor3D color;
 	if (mat->Get(pKey, type, index, color) == AI_SUCCESS) {
@@ -90,16 +300,31 @@ inline void Material::getColor(aiMaterial* mat, const char* pKey,
 	}
 }
 
-inline Texture Material::getTexture(aiMaterial * mat,
+inline fs::path MaterialData::getTexture(aiMaterial * mat,
 		const fs::path& directory, aiTextureType type, unsigned int index) {
 	aiString aiPath;
 	if (mat->GetTexture(type, index, &aiPath) != AI_SUCCESS)
-		return Texture();
-	fs::path path = directory / u8::to_path(aiPath.C_Str());
+		return fs::path();
+	return resolveTexture(directory, aiPath.C_Str());
+}
+
+inline fs::path MaterialData::resolveTexture(const fs::path& directory,
+		std::string_view filename) {
+	fs::path path = directory / u8::to_path(filename);
 	// Assume relative filename if wrong path is hard-coded
 	if (!fs::exists(path))
 		path = directory / path.filename();
-	return Texture(path);
+	return path;
+}
+
+inline void Material::getTexture(const fs::path& path, TextureLoader* loader,
+		Texture& out) {
+	if (path.empty())
+		out = Texture();
+	else if (loader)
+		out = loader->request(path);
+	else
+		out = Texture(path);
 }
 
 
@@ -1,36 +1,144 @@
 #pragma once
 
+#include <algorithm>
 #include <iostream>
+#include <span>
 #include <string>
 #include <vector>
 
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 
+#include "geometry_buffer.h"
+#include "gl_handle.h"
+#include "instance_buffer.h"
 #include "material.h"
+#include "meshlet.h"
 #include "shader.h"
+#include "vertex.h"
 
-struct Vertex
+// A simplified triangle list over the same vertices as the full mesh
+struct MeshLod
 {
-	glm::vec3 position;
-	glm::vec3 normal;
-	glm::vec2 texCoords;
+	std::vector<unsigned int> indices;
+	float error = 0.0f; // in object space units
+};
+
+// CPU-side mesh geometry, as imported or read back from the model cache
+struct MeshData
+{
+	std::string name;
+	std::vector<Vertex> vertices;
+	std::vector<unsigned int> indices;
+	unsigned int materialIndex = 0;
+	bool hasTexCoords = true;
+	// Coarser levels of detail, finest first
+	std::vector<MeshLod> lods{};
+	// Clusters of the full detail triangles
+	std::vector<Meshlet> meshlets{};
+};
+
+// What happens to a mesh's CPU copy of its geometry once it is uploaded
+enum class GeometryResidency
+{
+	Keep, // stays in memory
+	Release, // freed
+	Paged, // freed, and can be read back from the model cache
+};
+
+// Geometry bytes by where they live. A mesh's CPU copy counts as kept,
+// released or paged depending on its residency.
+struct GeometryMemory
+{
+	size_t kept = 0;
+	size_t released = 0;
+	size_t paged = 0;
+	size_t gpu = 0;
+
+	GeometryMemory& operator+=(const GeometryMemory& o) {
+		kept += o.kept;
+		released += o.released;
+		paged += o.paged;
+		gpu += o.gpu;
+		return *this;
+	}
 };
 
 class Mesh
 {
 public:
+	// A level of detail within the mesh's index data; LOD 0 is full detail
+	struct Lod {
+		size_t firstIndex = 0;
+		GLsizei indexCount = 0;
+		float error = 0.0f;
+	};
+
 	Mesh(std::vector<Vertex>&& vertices,
 		std::vector<unsigned int>&& indices,
 		const Material* material = nullptr)
 		: Mesh("", std::move(vertices), std::move(indices), material) {}
+	// With a geometry buffer the mesh is sub-allocated from it instead of
+	// getting its own buffers
+	Mesh(std::string_view name,
+		std::vector<Vertex>&& vertices,
+		std::vector<unsigned int>&& indices,
+		const Material* material = nullptr,
+		GeometryBuffer* geometry = nullptr);
+	// A mesh with buffers of its own, stored in the given vertex format
 	Mesh(std::string_view name,
 		std::vector<Vertex>&& vertices,
 		std::vector<unsigned int>&& indices,
-		const Material* material = nullptr);
-	void draw(const Shader& shader, bool useMaterial = true) const;
+		const Material* material,
+		const VertexFormat& format);
+	// Takes the mesh's LODs along; all of them share the vertices
+	Mesh(MeshData&& data, const Material* material, GeometryBuffer* geometry = nullptr);
+	// Owns its GL objects, so it can only be moved
+	Mesh(Mesh&&) noexcept = default;
+	Mesh& operator=(Mesh&&) noexcept = default;
+	// Draws leave the mesh's VAO bound; GLState skips binding it again
+	void draw(const Shader& shader, bool useMaterial = true, size_t lod = 0) const;
+	// Like draw, but expects the geometry buffer's VAO to be bound already
+	void drawBound(const Shader& shader, bool useMaterial = true, size_t lod = 0) const;
+	// Draws every instance in one call, with a shader compiled for instancing
+	void drawInstanced(const Shader& shader, std::span<const InstanceData> instances,
+		bool useMaterial = true, size_t lod = 0) const;
+	// For a mesh in a GeometryBuffer, the command that draws a LOD of it
+	DrawElementsIndirectCommand indirectCommand(size_t lod = 0) const;
+	GLenum drawIndexType() const { return allocation ? allocation.range().indexType : indexType; }
+	const VertexQuantization& vertexQuantization() const { return quantization; }
+	// Draws the full detail mesh without the meshlets the culler rejects
+	void drawCulled(const Shader& shader, const MeshletCuller& culler,
+		bool useMaterial = true) const;
+	void drawCulledBound(const Shader& shader, const MeshletCuller& culler,
+		bool useMaterial = true) const;
+	GeometryBuffer* geometry() const { return allocation.geometry(); }
+	const VertexFormat& vertexFormat() const { return format; }
+	size_t lodCount() const { return lods.size(); }
+	const Lod& lod(size_t i) const { return lods[i]; }
+	// Bounding sphere in object space
+	const glm::vec3& center() const { return boundsCenter; }
+	float radius() const { return boundsRadius; }
+	const std::vector<Meshlet>& getMeshlets() const { return meshlets; }
+
+	// Anything but Keep frees the CPU copy; drawing only needs the GPU one.
+	// Keep can't bring a freed copy back, see restoreGeometry(); returns
+	// false and leaves the residency as it is if that is asked for.
+	bool setResidency(GeometryResidency residency);
+	GeometryResidency residency() const { return residency_; }
+	// Puts back a copy of the full detail geometry, e.g. read from the cache
+	void restoreGeometry(std::vector<Vertex>&& vertices, std::vector<unsigned int>&& indices);
+	// Empty while the CPU copy is released or paged out
+	const std::vector<Vertex>& getVertices() const { return vertices; }
+	const std::vector<unsigned int>& getIndices() const { return indices; }
+	GeometryMemory memory() const;
 private:
-	void setupMesh();
+	void init(std::vector<MeshLod>&& coarseLods, GeometryBuffer* geometry);
+	void setupMesh(const std::vector<unsigned int>& allIndices);
+	void applyVertexFormat(const Shader& shader) const;
+	void bind() const;
+	void drawElements(size_t lod, GLsizei instances = 1) const;
+	void drawMeshlets(const MeshletCuller& culler) const;
 
 public:
 	std::string name;
@@ -38,58 +146,335 @@ public:
 private:
 	std::vector<Vertex> vertices;
 	std::vector<unsigned int> indices;
-	unsigned int vao, vbo, ebo;
+	std::vector<Lod> lods;
+	std::vector<Meshlet> meshlets;
+	glm::vec3 boundsCenter = glm::vec3(0.0f);
+	float boundsRadius = 0.0f;
+	VertexArrayHandle vao;
+	BufferHandle vbo, ebo;
+	mutable InstanceBuffer instances;
+	// Scratch for drawMeshlets, kept to reuse its allocation
+	struct MeshletDraws {
+		std::vector<GLsizei> counts;
+		std::vector<const void*> offsets;
+		std::vector<GLint> baseVertices;
+	};
+	mutable MeshletDraws meshletDraws;
+	GLenum indexType = GL_UNSIGNED_INT;
+	GeometryResidency residency_ = GeometryResidency::Keep;
+	size_t vertexCount = 0, indexCount = 0;
+	VertexFormat format;
+	VertexQuantization quantization;
+	GeometryBuffer::Allocation allocation;
+};
+
+// Picks the coarsest LOD whose error projects to at most maxPixelError
+// pixels on screen
+struct LodSelector
+{
+	glm::vec3 cameraPosition = glm::vec3(0.0f);
+	// Pixels per unit at a distance of 1, see perspectiveScale
+	float projectionScale = 1.0f;
+	float maxPixelError = 1.0f;
+
+	static float perspectiveScale(float fovy, float viewportHeight) {
+		return viewportHeight / (2.0f * glm::tan(fovy * 0.5f));
+	}
+	size_t select(const Mesh& mesh, const glm::mat4& model) const;
 };
 
 inline Mesh::Mesh(
 	std::string_view name,
 	std::vector<Vertex>&& vertices,
 	std::vector<unsigned int>&& indices,
-	const Material* material
+	const Material* material,
+	GeometryBuffer* geometry
 ) :
 	name(name),
+	material(material),
+	vertices(std::move(vertices)),
+	indices(std::move(indices))
+{
+	init({}, geometry);
+}
+
+inline Mesh::Mesh(
+	std::string_view name,
+	std::vector<Vertex>&& vertices,
+	std::vector<unsigned int>&& indices,
+	const Material* material,
+	const VertexFormat& format
+) :
+	name(name),
+	material(material),
 	vertices(std::move(vertices)),
 	indices(std::move(indices)),
-	material(material)
+	format(format)
+{
+	init({}, nullptr);
+}
+
+inline Mesh::Mesh(MeshData&& data, const Material* material, GeometryBuffer* geometry) :
+	name(std::move(data.name)),
+	material(material),
+	vertices(std::move(data.vertices)),
+	indices(std::move(data.indices)),
+	meshlets(std::move(data.meshlets))
+{
+	init(std::move(data.lods), geometry);
+}
+
+inline void Mesh::init(std::vector<MeshLod>&& coarseLods, GeometryBuffer* geometry)
+{
+	vertexCount = vertices.size();
+	indexCount = indices.size();
+	if (!vertices.empty()) {
+		glm::vec3 lo = vertices[0].position, hi = lo;
+		for (const Vertex& v : vertices) {
+			lo = glm::min(lo, v.position);
+			hi = glm::max(hi, v.position);
+		}
+		boundsCenter = (lo + hi) * 0.5f;
+		boundsRadius = glm::length(hi - lo) * 0.5f;
+	}
+
+	// All levels are uploaded back to back
+	std::vector<unsigned int> allIndices;
+	lods.push_back({ 0, GLsizei(indices.size()), 0.0f });
+	if (!coarseLods.empty()) {
+		allIndices = indices;
+		for (const MeshLod& lod : coarseLods) {
+			lods.push_back({ allIndices.size(), GLsizei(lod.indices.size()), lod.error });
+			allIndices.insert(allIndices.end(), lod.indices.begin(), lod.indices.end());
+		}
+	}
+	const std::vector<unsigned int>& uploadIndices = coarseLods.empty() ? indices : allIndices;
+
+	if (geometry) {
+		allocation = geometry->allocate(vertices, uploadIndices);
+		format = geometry->format();
+		quantization = allocation.range().quantization;
+	}
+	else {
+		setupMesh(uploadIndices);
+	}
+}
+
+inline void Mesh::setupMesh(const std::vector<unsigned int>& allIndices)
+{
+	vao = createVertexArray();
+	vbo = createBuffer();
+	instances = InstanceBuffer();
+	ebo = createBuffer();
+
+	std::vector<unsigned char> packed;
+	quantization = format.pack(vertices, packed);
+
+	GLState::shared().bindVertexArray(vao.get());
+	glBindBuffer(GL_ARRAY_BUFFER, vbo.get());
+	glBufferData(GL_ARRAY_BUFFER, packed.size(), packed.data(), GL_STATIC_DRAW);
+	indexType = indexTypeFor(vertices.size());
+	packIndices(allIndices, indexType, packed);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo.get());
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, packed.size(), packed.data(), GL_STATIC_DRAW);
+
+	format.setupAttributes();
+	GLState::shared().bindVertexArray(0);
+}
+
+inline void Mesh::bind() const
+{
+	if (allocation)
+		allocation.geometry()->bind();
+	else
+		GLState::shared().bindVertexArray(vao.get());
+}
+
+// The vertex shader decodes positions and normals with these
+inline void Mesh::applyVertexFormat(const Shader& shader) const
+{
+	shader.setVec3("positionOffset", quantization.offset);
+	shader.setVec3("positionScale", quantization.scale);
+	shader.setBool("octNormals", format.normal == NormalFormat::Oct16);
+}
+
+inline void Mesh::draw(const Shader& shader, bool useMaterial, size_t lod) const
+{
+	if (material && useMaterial)
+		MaterialTracker::shared().apply(shader, *material);
+	applyVertexFormat(shader);
+	bind();
+	drawElements(lod);
+}
+
+inline void Mesh::drawBound(const Shader& shader, bool useMaterial, size_t lod) const
+{
+	if (material && useMaterial)
+		MaterialTracker::shared().apply(shader, *material);
+	applyVertexFormat(shader);
+	drawElements(lod);
+}
+
+inline void Mesh::drawInstanced(const Shader& shader, std::span<const InstanceData> instanceData,
+	bool useMaterial, size_t lod) const
 {
-	setupMesh();
+	if (instanceData.empty())
+		return;
+	if (material && useMaterial)
+		MaterialTracker::shared().apply(shader, *material);
+	applyVertexFormat(shader);
+	bind();
+	InstanceBuffer& buffer = allocation ? allocation.geometry()->instanceBuffer() : instances;
+	buffer.upload(instanceData);
+	buffer.attach();
+	drawElements(lod, GLsizei(instanceData.size()));
 }
 
-inline void Mesh::setupMesh()
+inline DrawElementsIndirectCommand Mesh::indirectCommand(size_t lod) const
 {
-	glGenVertexArrays(1, &vao);
-	glGenBuffers(1, &vbo);
-	glGenBuffers(1, &ebo);
+	const Lod& l = lods[std::min(lod, lods.size() - 1)];
+	const GeometryBuffer::Range& r = allocation.range();
+	GLuint firstIndex = GLuint(r.indexOffset / indexSize(r.indexType) + l.firstIndex);
+	return { GLuint(l.indexCount), 1, firstIndex, r.baseVertex, 0 };
+}
 
-	glBindVertexArray(vao);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex),
-		vertices.data(), GL_STATIC_DRAW);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int),
-		indices.data(), GL_STATIC_DRAW);
+inline void Mesh::drawElements(size_t lod, GLsizei instances) const
+{
+	const Lod& l = lods[std::min(lod, lods.size() - 1)];
+	if (allocation) {
+		const GeometryBuffer::Range& r = allocation.range();
+		auto offset = reinterpret_cast<void*>(r.indexOffset + l.firstIndex * indexSize(r.indexType));
+		if (instances == 1)
+			glDrawElementsBaseVertex(GL_TRIANGLES, l.indexCount, r.indexType, offset, r.baseVertex);
+		else
+			glDrawElementsInstancedBaseVertex(GL_TRIANGLES, l.indexCount, r.indexType, offset,
+				instances, r.baseVertex);
+	}
+	else {
+		auto offset = reinterpret_cast<void*>(l.firstIndex * indexSize(indexType));
+		if (instances == 1)
+			glDrawElements(GL_TRIANGLES, l.indexCount, indexType, offset);
+		else
+			glDrawElementsInstanced(GL_TRIANGLES, l.indexCount, indexType, offset, instances);
+	}
+}
 
-	// vertex positions
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-		reinterpret_cast<void*>(offsetof(Vertex, position)));
-	// vertex normals
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-		reinterpret_cast<void*>(offsetof(Vertex, normal)));
-	// vertex texture coords
-	glEnableVertexAttribArray(2);
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-		reinterpret_cast<void*>(offsetof(Vertex, texCoords)));
-	glBindVertexArray(0);
+inline void Mesh::drawCulled(const Shader& shader, const MeshletCuller& culler,
+	bool useMaterial) const
+{
+	bind();
+	drawCulledBound(shader, culler, useMaterial);
 }
 
-inline void Mesh::draw(const Shader& shader, bool useMaterial) const
+inline void Mesh::drawCulledBound(const Shader& shader, const MeshletCuller& culler,
+	bool useMaterial) const
 {
+	if (!culler.visible(boundsCenter, boundsRadius))
+		return;
 	if (material && useMaterial)
-		material->apply(shader);
+		MaterialTracker::shared().apply(shader, *material);
+	applyVertexFormat(shader);
+	if (meshlets.empty())
+		drawElements(0);
+	else
+		drawMeshlets(culler);
+}
+
+// Visible meshlets that are next to each other are merged into one range
+// of a multi-draw
+inline void Mesh::drawMeshlets(const MeshletCuller& culler) const
+{
+	auto& [counts, offsets, baseVertices] = meshletDraws;
+	counts.clear();
+	offsets.clear();
+
+	size_t baseOffset = 0;
+	GLint baseVertex = 0;
+	GLenum type = indexType;
+	if (allocation) {
+		const GeometryBuffer::Range& r = allocation.range();
+		baseOffset = r.indexOffset;
+		baseVertex = r.baseVertex;
+		type = r.indexType;
+	}
+	size_t size = indexSize(type);
+	size_t rangeEnd = SIZE_MAX;
+	for (const Meshlet& m : meshlets) {
+		if (!culler.visible(m))
+			continue;
+		if (m.firstIndex == rangeEnd) {
+			counts.back() += GLsizei(m.indexCount);
+		}
+		else {
+			counts.push_back(GLsizei(m.indexCount));
+			offsets.push_back(reinterpret_cast<const void*>(baseOffset + m.firstIndex * size));
+		}
+		rangeEnd = m.firstIndex + m.indexCount;
+	}
+	if (counts.empty())
+		return;
+	baseVertices.assign(counts.size(), baseVertex);
+	glMultiDrawElementsBaseVertex(GL_TRIANGLES, counts.data(), type,
+		offsets.data(), GLsizei(counts.size()), baseVertices.data());
+}
 
-	glBindVertexArray(vao);
-	glDrawElements(GL_TRIANGLES, GLsizei(indices.size()), GL_UNSIGNED_INT, 0);
-	glBindVertexArray(0);
+inline bool Mesh::setResidency(GeometryResidency residency)
+{
+	if (residency == GeometryResidency::Keep) {
+		if (residency_ != GeometryResidency::Keep) {
+			std::cerr << "ERROR::MESH::GEOMETRY_NOT_IN_MEMORY: " << name << std::endl;
+			return false;
+		}
+		return true;
+	}
+	residency_ = residency;
+	std::vector<Vertex>().swap(vertices);
+	std::vector<unsigned int>().swap(indices);
+	return true;
+}
+
+inline void Mesh::restoreGeometry(std::vector<Vertex>&& vertices,
+	std::vector<unsigned int>&& indices)
+{
+	if (vertices.size() != vertexCount || indices.size() != indexCount) {
+		std::cerr << "ERROR::MESH::RESTORED_GEOMETRY_MISMATCH: " << name << std::endl;
+		return;
+	}
+	this->vertices = std::move(vertices);
+	this->indices = std::move(indices);
+	residency_ = GeometryResidency::Keep;
+}
+
+inline GeometryMemory Mesh::memory() const
+{
+	GeometryMemory m;
+	size_t cpu = vertexCount * sizeof(Vertex) + indexCount * sizeof(unsigned int);
+	if (residency_ == GeometryResidency::Keep)
+		m.kept = cpu;
+	else if (residency_ == GeometryResidency::Release)
+		m.released = cpu;
+	else
+		m.paged = cpu;
+	GLenum type = allocation ? allocation.range().indexType : indexType;
+	size_t allIndices = lods.back().firstIndex + size_t(lods.back().indexCount);
+	m.gpu = vertexCount * format.stride() + allIndices * indexSize(type);
+	return m;
+}
+
+inline size_t LodSelector::select(const Mesh& mesh, const glm::mat4& model) const
+{
+	if (mesh.lodCount() <= 1)
+		return 0;
+	// errors scale with the largest axis scale of the model matrix
+	float scale = std::max({ glm::length(glm::vec3(model[0])),
+		glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2])) });
+	glm::vec3 center = glm::vec3(model * glm::vec4(mesh.center(), 1.0f));
+	float distance = glm::length(center - cameraPosition) - mesh.radius() * scale;
+	if (distance <= 0.0f)
+		return 0;
+	float unitsPerPixel = distance / (projectionScale * scale);
+	size_t lod = 0;
+	while (lod + 1 < mesh.lodCount() && mesh.lod(lod + 1).error <= maxPixelError * unitsPerPixel)
+		lod++;
+	return lod;
 }
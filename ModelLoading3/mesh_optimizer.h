@@ -0,0 +1,362 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <numeric>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "mesh.h"
+#include "model_data.h"
+#include "thread_pool.h"
+
+// Reorders imported geometry for the GPU: triangles for post-transform
+// vertex cache hits (Forsyth), clusters of triangles to reduce overdraw,
+// and vertices in order of first use for fetch locality. The triangles
+// themselves are unchanged.
+namespace mesh_optimizer {
+
+// Post-transform cache statistics, simulated with a FIFO cache.
+// ACMR is vertex shader runs per triangle, ATVR runs per vertex (ideal 1).
+struct CacheStats
+{
+	float acmr = 0.0f;
+	float atvr = 0.0f;
+};
+
+struct Report
+{
+	CacheStats before;
+	CacheStats after;
+	size_t triangles = 0;
+	// Before and after optimizeVertexFetch drops unused vertices
+	size_t verticesBefore = 0;
+	size_t vertices = 0;
+};
+
+constexpr unsigned int ANALYZE_CACHE_SIZE = 16;
+
+inline CacheStats analyzeVertexCache(const std::vector<unsigned int>& indices,
+	size_t vertexCount, unsigned int cacheSize = ANALYZE_CACHE_SIZE)
+{
+	CacheStats stats;
+	if (indices.empty() || vertexCount == 0)
+		return stats;
+	// a vertex is in the cache if it was added within the last cacheSize misses
+	std::vector<size_t> timestamps(vertexCount, 0);
+	std::vector<bool> used(vertexCount, false);
+	size_t misses = 0, usedCount = 0;
+	for (unsigned int index : indices) {
+		if (!used[index]) {
+			used[index] = true;
+			usedCount++;
+		}
+		if (timestamps[index] == 0 || misses - timestamps[index] >= cacheSize) {
+			misses++;
+			timestamps[index] = misses;
+		}
+	}
+	stats.acmr = float(misses) / float(indices.size() / 3);
+	stats.atvr = float(misses) / float(usedCount);
+	return stats;
+}
+
+namespace detail {
+
+constexpr int MAX_CACHE_SIZE = 32;
+constexpr float CACHE_DECAY_POWER = 1.5f;
+constexpr float LAST_TRI_SCORE = 0.75f;
+constexpr float VALENCE_BOOST_SCALE = 2.0f;
+constexpr float VALENCE_BOOST_POWER = 0.5f;
+
+inline float vertexScore(int cachePosition, unsigned int remainingTriangles)
+{
+	if (remainingTriangles == 0)
+		return -1.0f;
+	float score = 0.0f;
+	if (cachePosition >= 0) {
+		// the triangle just emitted is likely still in the cache
+		if (cachePosition < 3) {
+			score = LAST_TRI_SCORE;
+		}
+		else {
+			float scale = 1.0f / (MAX_CACHE_SIZE - 3);
+			score = std::pow(1.0f - (cachePosition - 3) * scale, CACHE_DECAY_POWER);
+		}
+	}
+	// prefer vertices with few triangles left, so they don't linger
+	score += VALENCE_BOOST_SCALE * std::pow(float(remainingTriangles), -VALENCE_BOOST_POWER);
+	return score;
+}
+
+// Orders triangle clusters outside-in, so that outer surfaces, which tend to
+// occlude the rest of the mesh, are drawn first
+inline void optimizeOverdraw(std::vector<unsigned int>& indices,
+	const std::vector<Vertex>& vertices)
+{
+	size_t numTriangles = indices.size() / 3;
+	if (numTriangles < 2)
+		return;
+
+	// A cluster starts wherever the vertex cache has been flushed (a triangle
+	// with three misses), so moving clusters around keeps most of the hits
+	std::vector<size_t> clusterStarts;
+	std::vector<size_t> timestamps(vertices.size(), 0);
+	size_t misses = 0;
+	for (size_t tri = 0; tri < numTriangles; tri++) {
+		int triMisses = 0;
+		for (int k = 0; k < 3; k++) {
+			unsigned int index = indices[tri * 3 + k];
+			if (timestamps[index] == 0 || misses - timestamps[index] >= ANALYZE_CACHE_SIZE) {
+				misses++;
+				timestamps[index] = misses;
+				triMisses++;
+			}
+		}
+		if (tri == 0 || triMisses == 3)
+			clusterStarts.push_back(tri);
+	}
+	clusterStarts.push_back(numTriangles);
+	size_t numClusters = clusterStarts.size() - 1;
+	if (numClusters < 2)
+		return;
+
+	glm::vec3 meshCentroid(0.0f);
+	for (const Vertex& v : vertices)
+		meshCentroid += v.position;
+	meshCentroid /= float(vertices.size());
+
+	std::vector<float> sortKeys(numClusters);
+	for (size_t c = 0; c < numClusters; c++) {
+		glm::vec3 centroid(0.0f), normal(0.0f);
+		float area = 0.0f;
+		for (size_t tri = clusterStarts[c]; tri < clusterStarts[c + 1]; tri++) {
+			const glm::vec3& a = vertices[indices[tri * 3 + 0]].position;
+			const glm::vec3& b = vertices[indices[tri * 3 + 1]].position;
+			const glm::vec3& d = vertices[indices[tri * 3 + 2]].position;
+			glm::vec3 n = glm::cross(b - a, d - a); // length is twice the area
+			float triArea = glm::length(n);
+			centroid += (a + b + d) * (triArea / 3.0f);
+			normal += n;
+			area += triArea;
+		}
+		if (area > 0.0f)
+			centroid /= area;
+		float length = glm::length(normal);
+		sortKeys[c] = length > 0.0f ? glm::dot(centroid - meshCentroid, normal / length) : 0.0f;
+	}
+
+	std::vector<size_t> order(numClusters);
+	std::iota(order.begin(), order.end(), size_t(0));
+	std::stable_sort(order.begin(), order.end(),
+		[&](size_t a, size_t b) { return sortKeys[a] > sortKeys[b]; });
+
+	std::vector<unsigned int> result;
+	result.reserve(indices.size());
+	for (size_t c : order) {
+		result.insert(result.end(), indices.begin() + clusterStarts[c] * 3,
+			indices.begin() + clusterStarts[c + 1] * 3);
+	}
+	indices = std::move(result);
+}
+
+}
+
+// Tom Forsyth, "Linear-Speed Vertex Cache Optimisation"
+inline void optimizeVertexCache(std::vector<unsigned int>& indices, size_t vertexCount)
+{
+	using namespace detail;
+	size_t numTriangles = indices.size() / 3;
+	if (numTriangles == 0)
+		return;
+
+	// Triangles using each vertex
+	std::vector<unsigned int> remaining(vertexCount, 0);
+	for (unsigned int index : indices)
+		remaining[index]++;
+	std::vector<unsigned int> firstTriangle(vertexCount + 1, 0);
+	for (size_t v = 0; v < vertexCount; v++)
+		firstTriangle[v + 1] = firstTriangle[v] + remaining[v];
+	std::vector<unsigned int> adjacency(indices.size());
+	{
+		std::vector<unsigned int> fill(firstTriangle.begin(), firstTriangle.end() - 1);
+		for (size_t i = 0; i < indices.size(); i++)
+			adjacency[fill[indices[i]]++] = unsigned(i / 3);
+	}
+
+	std::vector<int> cachePosition(vertexCount, -1);
+	std::vector<float> vertexScores(vertexCount);
+	for (size_t v = 0; v < vertexCount; v++)
+		vertexScores[v] = vertexScore(-1, remaining[v]);
+	std::vector<float> triangleScores(numTriangles);
+	for (size_t tri = 0; tri < numTriangles; tri++) {
+		triangleScores[tri] = vertexScores[indices[tri * 3]]
+			+ vertexScores[indices[tri * 3 + 1]] + vertexScores[indices[tri * 3 + 2]];
+	}
+	std::vector<bool> emitted(numTriangles, false);
+
+	std::vector<unsigned int> result;
+	result.reserve(indices.size());
+	std::vector<unsigned int> cache, newCache;
+	cache.reserve(MAX_CACHE_SIZE + 3);
+	newCache.reserve(MAX_CACHE_SIZE + 3);
+	size_t nextInput = 0;
+	int64_t best = -1;
+
+	while (result.size() < numTriangles * 3) {
+		if (best < 0) {
+			// nothing in the cache is connected to what's left; start anew
+			while (emitted[nextInput])
+				nextInput++;
+			best = int64_t(nextInput);
+		}
+		size_t tri = size_t(best);
+		emitted[tri] = true;
+		newCache.clear();
+		for (int k = 0; k < 3; k++) {
+			unsigned int v = indices[tri * 3 + k];
+			result.push_back(v);
+			if (std::find(newCache.begin(), newCache.end(), v) == newCache.end())
+				newCache.push_back(v);
+			// remove the triangle from the vertex's list of remaining ones
+			unsigned int* begin = &adjacency[firstTriangle[v]];
+			unsigned int* end = begin + remaining[v];
+			*std::find(begin, end, unsigned(tri)) = end[-1];
+			remaining[v]--;
+		}
+		size_t emittedCount = newCache.size();
+		for (unsigned int v : cache) {
+			if (std::find(newCache.begin(), newCache.begin() + emittedCount, v)
+				== newCache.begin() + emittedCount)
+				newCache.push_back(v);
+		}
+		// vertices pushed out of the cache
+		if (newCache.size() > size_t(MAX_CACHE_SIZE)) {
+			for (size_t i = MAX_CACHE_SIZE; i < newCache.size(); i++) {
+				unsigned int v = newCache[i];
+				cachePosition[v] = -1;
+				float delta = vertexScore(-1, remaining[v]) - vertexScores[v];
+				vertexScores[v] += delta;
+				for (unsigned int j = 0; j < remaining[v]; j++)
+					triangleScores[adjacency[firstTriangle[v] + j]] += delta;
+			}
+			newCache.resize(MAX_CACHE_SIZE);
+		}
+		std::swap(cache, newCache);
+
+		best = -1;
+		float bestScore = -1.0f;
+		for (size_t i = 0; i < cache.size(); i++) {
+			unsigned int v = cache[i];
+			cachePosition[v] = int(i);
+			float delta = vertexScore(int(i), remaining[v]) - vertexScores[v];
+			vertexScores[v] += delta;
+			for (unsigned int j = 0; j < remaining[v]; j++)
+				triangleScores[adjacency[firstTriangle[v] + j]] += delta;
+		}
+		for (unsigned int v : cache) {
+			for (unsigned int j = 0; j < remaining[v]; j++) {
+				unsigned int t = adjacency[firstTriangle[v] + j];
+				if (triangleScores[t] > bestScore) {
+					bestScore = triangleScores[t];
+					best = t;
+				}
+			}
+		}
+	}
+	indices = std::move(result);
+}
+
+// Renumbers vertices in order of first use and drops unused ones
+inline void optimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<unsigned int>& indices)
+{
+	constexpr unsigned int UNUSED = UINT32_MAX;
+	std::vector<unsigned int> remap(vertices.size(), UNUSED);
+	std::vector<Vertex> result;
+	result.reserve(vertices.size());
+	for (unsigned int& index : indices) {
+		if (remap[index] == UNUSED) {
+			remap[index] = unsigned(result.size());
+			result.push_back(vertices[index]);
+		}
+		index = remap[index];
+	}
+	vertices = std::move(result);
+}
+
+// Builds the mesh's meshlets, then restores vertex cache order within each
+// one, since growing the meshlets shuffles the triangles
+inline void buildMeshlets(MeshData& mesh)
+{
+	mesh.meshlets = ::buildMeshlets(mesh.indices, mesh.vertices);
+	std::vector<unsigned int> local, toGlobal;
+	std::vector<unsigned int> toLocal(mesh.vertices.size(), UINT32_MAX);
+	for (const Meshlet& m : mesh.meshlets) {
+		auto begin = mesh.indices.begin() + m.firstIndex;
+		auto end = begin + m.indexCount;
+		local.clear();
+		toGlobal.clear();
+		for (auto it = begin; it != end; ++it) {
+			if (toLocal[*it] == UINT32_MAX) {
+				toLocal[*it] = unsigned(toGlobal.size());
+				toGlobal.push_back(*it);
+			}
+			local.push_back(toLocal[*it]);
+		}
+		optimizeVertexCache(local, toGlobal.size());
+		for (size_t i = 0; i < local.size(); i++)
+			begin[i] = toGlobal[local[i]];
+		for (unsigned int v : toGlobal)
+			toLocal[v] = UINT32_MAX;
+	}
+}
+
+inline Report optimize(MeshData& mesh)
+{
+	Report report;
+	report.triangles = mesh.indices.size() / 3;
+	report.verticesBefore = mesh.vertices.size();
+	report.before = analyzeVertexCache(mesh.indices, mesh.vertices.size());
+	optimizeVertexCache(mesh.indices, mesh.vertices.size());
+	detail::optimizeOverdraw(mesh.indices, mesh.vertices);
+	optimizeVertexFetch(mesh.vertices, mesh.indices);
+	report.vertices = mesh.vertices.size();
+	report.after = analyzeVertexCache(mesh.indices, mesh.vertices.size());
+	return report;
+}
+
+// Optimizes every mesh in parallel; the report covers the whole model
+inline Report optimize(ModelData& data, ThreadPool& pool = ThreadPool::shared())
+{
+	std::vector<Report> reports(data.meshes.size());
+	pool.parallelFor(data.meshes.size(), [&](size_t i) {
+		reports[i] = optimize(data.meshes[i]);
+	});
+
+	Report total;
+	float missesBefore = 0.0f, missesAfter = 0.0f;
+	for (const Report& r : reports) {
+		total.triangles += r.triangles;
+		total.verticesBefore += r.verticesBefore;
+		total.vertices += r.vertices;
+		missesBefore += r.before.acmr * r.triangles;
+		missesAfter += r.after.acmr * r.triangles;
+	}
+	if (total.triangles > 0) {
+		total.before = { missesBefore / total.triangles, missesBefore / total.verticesBefore };
+		total.after = { missesAfter / total.triangles, missesAfter / total.vertices };
+	}
+	return total;
+}
+
+inline std::ostream& operator<<(std::ostream& os, const Report& report)
+{
+	return os << report.triangles << " triangles, " << report.vertices << " vertices, ACMR "
+		<< report.before.acmr << " -> " << report.after.acmr << ", ATVR "
+		<< report.before.atvr << " -> " << report.after.atvr;
+}
+
+}
@@ -0,0 +1,316 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "mesh.h"
+#include "mesh_optimizer.h"
+#include "model_data.h"
+#include "thread_pool.h"
+#include "utils.h"
+
+namespace mesh_optimizer {
+
+struct LodOptions
+{
+	// Including the full detail mesh
+	unsigned int maxLods = 4;
+	// Target triangle count of each LOD relative to the previous one
+	float reduction = 0.5f;
+	// Largest allowed error, relative to the mesh size
+	float maxError = 0.05f;
+};
+
+namespace detail {
+
+// Symmetric 4x4 matrix of the weighted sum of squared distances to a set of
+// planes, and the sum of the weights
+struct Quadric
+{
+	double a00 = 0, a01 = 0, a02 = 0, a03 = 0;
+	double a11 = 0, a12 = 0, a13 = 0;
+	double a22 = 0, a23 = 0;
+	double a33 = 0;
+	double weight = 0;
+
+	static Quadric plane(const glm::dvec3& n, double d, double weight) {
+		Quadric q;
+		q.a00 = weight * n.x * n.x; q.a01 = weight * n.x * n.y; q.a02 = weight * n.x * n.z; q.a03 = weight * n.x * d;
+		q.a11 = weight * n.y * n.y; q.a12 = weight * n.y * n.z; q.a13 = weight * n.y * d;
+		q.a22 = weight * n.z * n.z; q.a23 = weight * n.z * d;
+		q.a33 = weight * d * d;
+		q.weight = weight;
+		return q;
+	}
+	Quadric& operator+=(const Quadric& o) {
+		a00 += o.a00; a01 += o.a01; a02 += o.a02; a03 += o.a03;
+		a11 += o.a11; a12 += o.a12; a13 += o.a13;
+		a22 += o.a22; a23 += o.a23;
+		a33 += o.a33;
+		weight += o.weight;
+		return *this;
+	}
+	double error(const glm::vec3& p) const {
+		double x = p.x, y = p.y, z = p.z;
+		double e = a00 * x * x + 2 * a01 * x * y + 2 * a02 * x * z + 2 * a03 * x
+			+ a11 * y * y + 2 * a12 * y * z + 2 * a13 * y
+			+ a22 * z * z + 2 * a23 * z
+			+ a33;
+		return std::max(e, 0.0);
+	}
+	// The weighted mean squared distance, in squared object space units
+	double distance2(const glm::vec3& p) const {
+		return weight > 0.0 ? error(p) / weight : 0.0;
+	}
+};
+
+struct Collapse
+{
+	unsigned int from, to; // position groups
+	double cost; // area weighted, to order the collapses
+	double distance2; // cost divided by the area, to bound the error
+};
+
+inline uint64_t edgeKey(unsigned int a, unsigned int b)
+{
+	if (a > b)
+		std::swap(a, b);
+	return uint64_t(a) << 32 | b;
+}
+
+}
+
+// Quadric error edge collapse (Garland and Heckbert). Vertices only ever
+// collapse onto other existing vertices, so the result indexes the same
+// vertex array. Vertices with the same position but different attributes
+// (seams) move together, and open borders stay in place. Returns the new
+// indices, and the largest error introduced in *resultError, in object space
+// units.
+inline std::vector<unsigned int> simplify(const std::vector<unsigned int>& indices,
+	const std::vector<Vertex>& vertices, size_t targetIndexCount, float targetError,
+	float* resultError = nullptr)
+{
+	using namespace detail;
+	size_t vertexCount = vertices.size();
+	std::vector<unsigned int> result(indices.begin(), indices.begin() + indices.size() / 3 * 3);
+	double maxDistance2 = double(targetError) * targetError;
+	double worstDistance2 = 0.0;
+
+	// Position groups, represented by their first vertex
+	std::vector<unsigned int> group(vertexCount);
+	{
+		struct PositionHash {
+			size_t operator()(const glm::vec3& p) const {
+				return util::fnv1a(&p, sizeof(p));
+			}
+		};
+		std::unordered_map<glm::vec3, unsigned int, PositionHash> firstOfPosition;
+		firstOfPosition.reserve(vertexCount);
+		for (unsigned int v = 0; v < vertexCount; v++)
+			group[v] = firstOfPosition.try_emplace(vertices[v].position, v).first->second;
+	}
+
+	// Area weighted plane quadrics, per group
+	std::vector<Quadric> quadrics(vertexCount);
+	for (size_t i = 0; i < result.size(); i += 3) {
+		glm::dvec3 a = vertices[result[i]].position;
+		glm::dvec3 b = vertices[result[i + 1]].position;
+		glm::dvec3 c = vertices[result[i + 2]].position;
+		glm::dvec3 n = glm::cross(b - a, c - a);
+		double length = glm::length(n);
+		if (length == 0.0)
+			continue;
+		n /= length;
+		Quadric q = Quadric::plane(n, -glm::dot(n, a), length * 0.5);
+		for (int k = 0; k < 3; k++)
+			quadrics[group[result[i + k]]] += q;
+	}
+
+	std::vector<unsigned int> remap(vertexCount);
+	std::vector<unsigned int> firstTriangle(vertexCount + 1), adjacency;
+	std::vector<std::vector<unsigned int>> members(vertexCount);
+	std::vector<bool> locked(vertexCount), touched(vertexCount);
+	std::unordered_map<uint64_t, unsigned int> edgeUses;
+	std::vector<Collapse> collapses;
+
+	while (result.size() > targetIndexCount) {
+		size_t numTriangles = result.size() / 3;
+
+		// Vertex to triangle adjacency, and the vertices of each group
+		std::fill(firstTriangle.begin(), firstTriangle.end(), 0);
+		for (unsigned int index : result)
+			firstTriangle[index + 1]++;
+		for (size_t v = 0; v < vertexCount; v++)
+			firstTriangle[v + 1] += firstTriangle[v];
+		adjacency.resize(result.size());
+		{
+			std::vector<unsigned int> fill(firstTriangle.begin(), firstTriangle.end() - 1);
+			for (size_t i = 0; i < result.size(); i++)
+				adjacency[fill[result[i]]++] = unsigned(i / 3);
+		}
+		for (auto& m : members)
+			m.clear();
+		for (unsigned int v = 0; v < vertexCount; v++) {
+			if (firstTriangle[v + 1] > firstTriangle[v])
+				members[group[v]].push_back(v);
+		}
+
+		// Borders and non-manifold edges are locked
+		edgeUses.clear();
+		for (size_t i = 0; i < result.size(); i += 3) {
+			for (int k = 0; k < 3; k++) {
+				unsigned int a = group[result[i + k]], b = group[result[i + (k + 1) % 3]];
+				edgeUses[edgeKey(a, b)]++;
+			}
+		}
+		std::fill(locked.begin(), locked.end(), false);
+		for (auto [key, uses] : edgeUses) {
+			if (uses != 2) {
+				locked[unsigned(key >> 32)] = true;
+				locked[unsigned(key)] = true;
+			}
+		}
+
+		collapses.clear();
+		for (size_t i = 0; i < result.size(); i += 3) {
+			for (int k = 0; k < 3; k++) {
+				unsigned int a = group[result[i + k]], b = group[result[i + (k + 1) % 3]];
+				if (a == b)
+					continue;
+				Quadric q = quadrics[a];
+				q += quadrics[b];
+				if (!locked[a])
+					collapses.push_back({ a, b, q.error(vertices[b].position), q.distance2(vertices[b].position) });
+				if (!locked[b])
+					collapses.push_back({ b, a, q.error(vertices[a].position), q.distance2(vertices[a].position) });
+			}
+		}
+		std::sort(collapses.begin(), collapses.end(),
+			[](const Collapse& x, const Collapse& y) { return x.cost < y.cost; });
+
+		// Collapse the cheapest edges whose neighborhoods don't overlap
+		for (unsigned int v = 0; v < vertexCount; v++)
+			remap[v] = v;
+		std::fill(touched.begin(), touched.end(), false);
+		size_t removeTriangles = (result.size() - targetIndexCount) / 3;
+		size_t removed = 0, performed = 0;
+		for (const Collapse& c : collapses) {
+			if (removed >= removeTriangles)
+				break;
+			if (c.distance2 > maxDistance2 || touched[c.from] || touched[c.to])
+				continue;
+
+			// Every vertex of the group needs an edge into the target group
+			// to collapse along, and no triangle may flip over
+			bool valid = true;
+			size_t collapsedTriangles = 0;
+			glm::vec3 target = vertices[c.to].position;
+			for (unsigned int v : members[c.from]) {
+				unsigned int along = UINT32_MAX;
+				for (unsigned int j = firstTriangle[v]; j < firstTriangle[v + 1] && valid; j++) {
+					const unsigned int* tri = &result[adjacency[j] * 3];
+					int corner = tri[0] == v ? 0 : tri[1] == v ? 1 : 2;
+					unsigned int v1 = tri[(corner + 1) % 3], v2 = tri[(corner + 2) % 3];
+					if (group[v1] == c.to || group[v2] == c.to) {
+						along = group[v1] == c.to ? v1 : v2;
+						collapsedTriangles++;
+						continue;
+					}
+					glm::vec3 p0 = vertices[v].position, p1 = vertices[v1].position, p2 = vertices[v2].position;
+					glm::vec3 before = glm::cross(p1 - p0, p2 - p0);
+					glm::vec3 after = glm::cross(p1 - target, p2 - target);
+					if (glm::dot(before, after) <= 0.0f)
+						valid = false;
+				}
+				if (along == UINT32_MAX)
+					valid = false;
+				if (!valid)
+					break;
+				remap[v] = along;
+			}
+			if (!valid) {
+				for (unsigned int v : members[c.from])
+					remap[v] = v;
+				continue;
+			}
+
+			// Lock the neighborhood for the rest of this pass
+			for (unsigned int v : members[c.from]) {
+				for (unsigned int j = firstTriangle[v]; j < firstTriangle[v + 1]; j++) {
+					const unsigned int* tri = &result[adjacency[j] * 3];
+					for (int k = 0; k < 3; k++)
+						touched[group[tri[k]]] = true;
+				}
+			}
+			quadrics[c.to] += quadrics[c.from];
+			worstDistance2 = std::max(worstDistance2, c.distance2);
+			// each vertex of a seam collapses its own triangles
+			removed += collapsedTriangles / std::max<size_t>(members[c.from].size(), 1);
+			performed++;
+		}
+		if (performed == 0)
+			break;
+
+		// Rewrite the triangles, dropping the collapsed ones
+		size_t out = 0;
+		for (size_t i = 0; i < numTriangles; i++) {
+			unsigned int a = remap[result[i * 3]], b = remap[result[i * 3 + 1]], c = remap[result[i * 3 + 2]];
+			if (a == b || b == c || a == c)
+				continue;
+			result[out++] = a;
+			result[out++] = b;
+			result[out++] = c;
+		}
+		result.resize(out);
+	}
+
+	if (resultError)
+		*resultError = float(std::sqrt(worstDistance2));
+	return result;
+}
+
+// Appends up to options.maxLods - 1 simplified index lists to mesh.lods,
+// coarsest last. Each one is simplified from the full detail triangles.
+inline void generateLods(MeshData& mesh, const LodOptions& options = {})
+{
+	mesh.lods.clear();
+	if (mesh.vertices.empty() || mesh.indices.empty())
+		return;
+	glm::vec3 lo = mesh.vertices[0].position, hi = lo;
+	for (const Vertex& v : mesh.vertices) {
+		lo = glm::min(lo, v.position);
+		hi = glm::max(hi, v.position);
+	}
+	float size = glm::length(hi - lo);
+	float maxError = options.maxError * size;
+
+	size_t previousCount = mesh.indices.size();
+	float ratio = 1.0f;
+	for (unsigned int i = 1; i < options.maxLods; i++) {
+		ratio *= options.reduction;
+		size_t target = size_t(mesh.indices.size() / 3 * ratio) * 3;
+		float error = 0.0f;
+		std::vector<unsigned int> lod = simplify(mesh.indices, mesh.vertices, target, maxError, &error);
+		// stop when the error bound keeps it from getting much simpler
+		if (lod.empty() || lod.size() > previousCount * 9 / 10)
+			break;
+		optimizeVertexCache(lod, mesh.vertices.size());
+		previousCount = lod.size();
+		mesh.lods.push_back({ std::move(lod), error });
+	}
+}
+
+inline void generateLods(ModelData& data, const LodOptions& options = {},
+	ThreadPool& pool = ThreadPool::shared())
+{
+	pool.parallelFor(data.meshes.size(), [&](size_t i) {
+		generateLods(data.meshes[i], options);
+	});
+}
+
+}
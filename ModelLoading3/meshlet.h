@@ -0,0 +1,249 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "vertex.h"
+
+// A small cluster of a mesh's triangles, contiguous in its index data, with
+// bounds for culling it on the CPU
+struct Meshlet
+{
+	static constexpr size_t MAX_VERTICES = 64;
+	static constexpr size_t MAX_TRIANGLES = 124;
+
+	uint32_t firstIndex = 0; // into the mesh's full detail indices
+	uint32_t indexCount = 0;
+	// Bounding sphere, in object space
+	glm::vec3 center = glm::vec3(0.0f);
+	float radius = 0.0f;
+	// All triangle normals are within the cone around coneAxis. coneCutoff
+	// is the sine of its half angle; 1 means the cone can't be culled.
+	glm::vec3 coneAxis = glm::vec3(0.0f, 0.0f, 1.0f);
+	float coneCutoff = 1.0f;
+};
+
+namespace detail {
+
+inline Meshlet meshletBounds(const std::vector<unsigned int>& indices,
+	const std::vector<Vertex>& vertices, const std::vector<glm::vec3>& faceNormals,
+	size_t firstIndex, size_t indexCount)
+{
+	Meshlet m;
+	m.firstIndex = uint32_t(firstIndex);
+	m.indexCount = uint32_t(indexCount);
+
+	glm::vec3 lo = vertices[indices[firstIndex]].position, hi = lo;
+	for (size_t i = firstIndex; i < firstIndex + indexCount; i++) {
+		lo = glm::min(lo, vertices[indices[i]].position);
+		hi = glm::max(hi, vertices[indices[i]].position);
+	}
+	m.center = (lo + hi) * 0.5f;
+	for (size_t i = firstIndex; i < firstIndex + indexCount; i++)
+		m.radius = std::max(m.radius, glm::length(vertices[indices[i]].position - m.center));
+
+	// Normal cone around the average face normal
+	glm::vec3 axis(0.0f);
+	for (size_t tri = firstIndex / 3; tri < (firstIndex + indexCount) / 3; tri++)
+		axis += faceNormals[tri];
+	float axisLength = glm::length(axis);
+	if (axisLength == 0.0f)
+		return m;
+	axis /= axisLength;
+	float minDot = 1.0f;
+	for (size_t tri = firstIndex / 3; tri < (firstIndex + indexCount) / 3; tri++) {
+		if (faceNormals[tri] != glm::vec3(0.0f))
+			minDot = std::min(minDot, glm::dot(axis, faceNormals[tri]));
+	}
+	if (minDot > 0.0f) {
+		m.coneAxis = axis;
+		m.coneCutoff = std::sqrt(1.0f - minDot * minDot);
+	}
+	return m;
+}
+
+}
+
+// Grows meshlets over connected triangles, preferring ones that add few
+// vertices and that face the same way as the meshlet so far, which keeps the
+// normal cones narrow. Seeds are taken in index order, so the order from
+// vertex cache and overdraw optimization is mostly kept. The indices are
+// reordered so that each meshlet is a contiguous range.
+inline std::vector<Meshlet> buildMeshlets(std::vector<unsigned int>& indices,
+	const std::vector<Vertex>& vertices)
+{
+	constexpr float CONE_WEIGHT = 0.5f;
+	size_t numTriangles = indices.size() / 3;
+	size_t vertexCount = vertices.size();
+	std::vector<Meshlet> meshlets;
+	if (numTriangles == 0)
+		return meshlets;
+
+	std::vector<glm::vec3> faceNormals(numTriangles);
+	for (size_t tri = 0; tri < numTriangles; tri++) {
+		const glm::vec3& a = vertices[indices[tri * 3]].position;
+		const glm::vec3& b = vertices[indices[tri * 3 + 1]].position;
+		const glm::vec3& c = vertices[indices[tri * 3 + 2]].position;
+		glm::vec3 n = glm::cross(b - a, c - a);
+		float length = glm::length(n);
+		faceNormals[tri] = length > 0.0f ? n / length : glm::vec3(0.0f);
+	}
+
+	// Triangles using each vertex
+	std::vector<unsigned int> firstTriangle(vertexCount + 1, 0);
+	for (size_t i = 0; i < numTriangles * 3; i++)
+		firstTriangle[indices[i] + 1]++;
+	for (size_t v = 0; v < vertexCount; v++)
+		firstTriangle[v + 1] += firstTriangle[v];
+	std::vector<unsigned int> adjacency(numTriangles * 3);
+	{
+		std::vector<unsigned int> fill(firstTriangle.begin(), firstTriangle.end() - 1);
+		for (size_t i = 0; i < numTriangles * 3; i++)
+			adjacency[fill[indices[i]]++] = unsigned(i / 3);
+	}
+
+	std::vector<bool> emitted(numTriangles, false);
+	std::vector<uint32_t> lastUse(vertexCount, UINT32_MAX);
+	std::vector<unsigned int> meshletVertices;
+	std::vector<unsigned int> result;
+	std::vector<glm::vec3> resultNormals;
+	result.reserve(numTriangles * 3);
+	resultNormals.reserve(numTriangles);
+	size_t nextSeed = 0;
+
+	while (result.size() < numTriangles * 3) {
+		while (emitted[nextSeed])
+			nextSeed++;
+		uint32_t id = uint32_t(meshlets.size());
+		size_t first = result.size();
+		meshletVertices.clear();
+		glm::vec3 normalSum(0.0f);
+		size_t tri = nextSeed;
+
+		while (true) {
+			emitted[tri] = true;
+			for (int k = 0; k < 3; k++) {
+				unsigned int v = indices[tri * 3 + k];
+				if (lastUse[v] != id) {
+					lastUse[v] = id;
+					meshletVertices.push_back(v);
+				}
+				result.push_back(v);
+			}
+			resultNormals.push_back(faceNormals[tri]);
+			normalSum += faceNormals[tri];
+			if ((result.size() - first) / 3 == Meshlet::MAX_TRIANGLES)
+				break;
+
+			float length = glm::length(normalSum);
+			glm::vec3 axis = length > 0.0f ? normalSum / length : glm::vec3(0.0f);
+			int64_t best = -1;
+			float bestScore = FLT_MAX;
+			for (unsigned int v : meshletVertices) {
+				for (unsigned int j = firstTriangle[v]; j < firstTriangle[v + 1]; j++) {
+					unsigned int t = adjacency[j];
+					if (emitted[t])
+						continue;
+					size_t newVertices = 0;
+					for (int k = 0; k < 3; k++)
+						newVertices += lastUse[indices[t * 3 + k]] != id;
+					if (meshletVertices.size() + newVertices > Meshlet::MAX_VERTICES)
+						continue;
+					float score = float(newVertices)
+						+ CONE_WEIGHT * (1.0f - glm::dot(axis, faceNormals[t]));
+					if (score < bestScore) {
+						bestScore = score;
+						best = t;
+					}
+				}
+			}
+			// nothing connected fits any more
+			if (best < 0)
+				break;
+			tri = size_t(best);
+		}
+		meshlets.push_back(detail::meshletBounds(result, vertices, resultNormals,
+			first, result.size() - first));
+	}
+	indices = std::move(result);
+	return meshlets;
+}
+
+// View frustum and back-face culling for one model, done in the model's
+// object space
+class MeshletCuller
+{
+public:
+	MeshletCuller(const glm::mat4& projection, const glm::mat4& view,
+		const glm::mat4& model, const glm::vec3& cameraPosition);
+
+	const glm::mat4& modelMatrix() const { return model; }
+	// The same view, for a part of the model with its own transform
+	MeshletCuller transformed(const glm::mat4& local) const;
+	bool visible(const glm::vec3& center, float radius) const;
+	bool visible(const Meshlet& meshlet) const;
+
+private:
+	MeshletCuller(const glm::mat4& viewProjection, const glm::mat4& model,
+		const glm::vec3& cameraPosition);
+
+	glm::mat4 viewProjection;
+	glm::mat4 model;
+	glm::vec3 cameraPosition;
+	glm::vec4 planes[6];
+	glm::vec3 camera;
+};
+
+inline MeshletCuller::MeshletCuller(const glm::mat4& projection, const glm::mat4& view,
+	const glm::mat4& model, const glm::vec3& cameraPosition)
+	: MeshletCuller(projection * view, model, cameraPosition)
+{
+}
+
+inline MeshletCuller MeshletCuller::transformed(const glm::mat4& local) const
+{
+	return MeshletCuller(viewProjection, model * local, cameraPosition);
+}
+
+inline MeshletCuller::MeshletCuller(const glm::mat4& viewProjection, const glm::mat4& model,
+	const glm::vec3& cameraPosition)
+	: viewProjection(viewProjection), model(model), cameraPosition(cameraPosition)
+{
+	// Gribb and Hartmann: the planes are sums of the matrix rows
+	glm::mat4 m = viewProjection * model;
+	glm::vec4 rows[4];
+	for (int i = 0; i < 4; i++)
+		rows[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+	for (int i = 0; i < 3; i++) {
+		planes[i * 2] = rows[3] + rows[i];
+		planes[i * 2 + 1] = rows[3] - rows[i];
+	}
+	for (glm::vec4& plane : planes)
+		plane /= glm::length(glm::vec3(plane));
+	camera = glm::vec3(glm::inverse(model) * glm::vec4(cameraPosition, 1.0f));
+}
+
+inline bool MeshletCuller::visible(const glm::vec3& center, float radius) const
+{
+	for (const glm::vec4& plane : planes) {
+		if (glm::dot(glm::vec3(plane), center) + plane.w < -radius)
+			return false;
+	}
+	return true;
+}
+
+inline bool MeshletCuller::visible(const Meshlet& meshlet) const
+{
+	// every triangle faces away if the camera is outside the normal cone,
+	// widened by the bounding sphere
+	glm::vec3 toCenter = meshlet.center - camera;
+	if (glm::dot(toCenter, meshlet.coneAxis)
+		>= meshlet.coneCutoff * glm::length(toCenter) + meshlet.radius)
+		return false;
+	return visible(meshlet.center, meshlet.radius);
+}
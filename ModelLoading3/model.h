@@ -1,17 +1,31 @@
 #pragma once
 
+#include <algorithm>
 #include <iostream>
 #include <string>
+#include <tuple>
 #include <vector>
 #include <filesystem>
+#include <memory>
 
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
 
+#include "geometry_buffer.h"
 #include "material.h"
 #include "mesh.h"
+#include "mesh_optimizer.h"
+#include "mesh_simplifier.h"
+#include "model_data.h"
+#include "model_cache.h"
+#include "name_index.h"
+#include "obj_loader.h"
 #include "shader.h"
+#include "shader_permutations.h"
 #include "u8tils.h"
 
 namespace fs = std::filesystem;
@@ -19,25 +33,250 @@ namespace fs = std::filesystem;
 constexpr int DEFAULT_FLAGS =
 	aiProcess_GenNormals | aiProcess_JoinIdenticalVertices |
 	aiProcess_Triangulate | aiProcess_PreTransformVertices;
+// Keeps the node hierarchy: each mesh is stored once, and nodes reference
+// it with their own transforms
+constexpr int HIERARCHY_FLAGS = DEFAULT_FLAGS & ~aiProcess_PreTransformVertices;
+
+struct ModelOptions
+{
+	bool forceSmooth = false;
+	unsigned int flags = DEFAULT_FLAGS;
+	bool useCache = true;
+	// Reorder triangles and vertices for the GPU after import, see mesh_optimizer
+	bool optimizeMeshes = true;
+	// Simplified levels of detail for each mesh, see Model::draw
+	bool generateLods = true;
+	mesh_optimizer::LodOptions lod{};
+	// Meshlets with culling bounds for each mesh, see Model::draw
+	bool buildMeshlets = true;
+	// Layout of the model's own geometry buffer. The texture coordinate
+	// stream is dropped if no mesh has texture coordinates.
+	VertexFormat vertexFormat{};
+	// Meshes are sub-allocated from geometry; if it is null, the model creates
+	// a buffer of its own. Passing the same buffer to several models lets a
+	// whole scene share one.
+	std::shared_ptr<GeometryBuffer> geometry{};
+	// What happens to the CPU copy of the geometry after upload. Paged
+	// needs the model cache and keeps the copy if there is none.
+	GeometryResidency residency = GeometryResidency::Keep;
+
+	// Hash of the options that change the imported data
+	uint64_t importKey() const;
+};
 
 class Model
 {
 public:
-	Model(const fs::path& path, bool forceSmooth = false,
-		unsigned int flags = DEFAULT_FLAGS);
+	struct Node {
+		std::string name;
+		glm::mat4 transform; // relative to the parent
+		glm::mat4 globalTransform; // relative to the model
+		int parent;
+		std::vector<unsigned int> meshes;
+	};
+
+	explicit Model(const fs::path& path, const ModelOptions& options = {});
+	Model(const fs::path& path, bool forceSmooth, unsigned int flags = DEFAULT_FLAGS)
+		: Model(path, ModelOptions{ .forceSmooth = forceSmooth, .flags = flags }) {}
+	// With a loader, textures stay empty until the loader uploads them
+	explicit Model(ModelData&& data, TextureLoader* loader = nullptr,
+		const ModelOptions& options = {});
+	// Models with a node hierarchy set the "model" uniform for each node, to
+	// modelMatrix times the node's transform. Other models leave it alone.
 	void draw(const Shader& shader, bool useMaterial = true) const;
-	Material* getMaterial(std::string_view name);
-	Mesh* getMesh(std::string_view name);
+	void draw(const Shader& shader, const glm::mat4& modelMatrix,
+		bool useMaterial = true) const;
+	// Draws each mesh at the LOD the selector picks for it; modelMatrix is
+	// the matrix the shader draws the model with
+	void draw(const Shader& shader, const LodSelector& selector,
+		const glm::mat4& modelMatrix, bool useMaterial = true) const;
+	// Also culls meshes, and the meshlets of meshes drawn at full detail
+	void draw(const Shader& shader, const LodSelector& selector,
+		const MeshletCuller& culler, bool useMaterial = true) const;
+	// Draws each mesh with the permutation for its material and the lights,
+	// switching programs only between meshes that need different ones. Sets
+	// "model" on every program it uses.
+	void draw(ShaderPermutations& shaders, const ShaderFeatures& lights,
+		const LodSelector& selector, const MeshletCuller& culler) const;
+	// Draws the meshes in the geometry buffer with one multi-draw per
+	// material, at full detail and without culling; other meshes are drawn
+	// one by one. With GL 4.3 that is a glMultiDrawElementsIndirect over
+	// commands built once, and each draw reads its transform as InstanceData
+	// through its base instance. Otherwise glMultiDrawElementsBaseVertex
+	// merges the draws of a material that share a node and quantization.
+	void drawBatched(ShaderPermutations& shaders, const ShaderFeatures& lights,
+		const glm::mat4& modelMatrix) const;
+	static bool multiDrawIndirect() {
+		return GLAD_GL_VERSION_4_3 && glMultiDrawElementsIndirect;
+	}
+	// Hashed lookups; pass a NameKey to reuse a precomputed hash
+	Material* getMaterial(std::string_view name) { return getMaterial(NameKey(name)); }
+	Material* getMaterial(const NameKey& key);
+	Mesh* getMesh(std::string_view name) { return getMesh(NameKey(name)); }
+	Mesh* getMesh(const NameKey& key);
+
+	// Recompiles the materials, e.g. once their textures are uploaded
+	void compileMaterials();
+	// Applies a residency policy to every mesh, see ModelOptions::residency.
+	// Keep first reads paged out geometry back; returns false if some mesh
+	// is left without its CPU copy.
+	bool setResidency(GeometryResidency residency);
+	// Reads paged out geometry back from the model cache
+	bool restoreGeometry();
+	GeometryMemory geometryMemory() const;
+
+	// Load from the binary cache if it is up to date, otherwise import and
+	// refresh the cache
+	static bool loadData(const fs::path& path, ModelData& data,
+		const ModelOptions& options = {});
+	static bool importData(const fs::path& path, ModelData& data,
+		bool forceSmooth = false, unsigned int flags = DEFAULT_FLAGS);
+	static bool importAssimp(const fs::path& path, ModelData& data,
+		bool forceSmooth = false, unsigned int flags = DEFAULT_FLAGS);
 private:
-	void processNode(aiNode* node, const aiScene* scene);
-	void processMesh(aiMesh* mesh);
+	void build(ModelData&& data, TextureLoader& loader, const ModelOptions& options);
+	static void processNode(aiNode* node, const aiScene* scene, ModelData& data);
+	static void processHierarchy(aiNode* node, int parent, ModelData& data);
+	static void processMesh(aiMesh* mesh, ModelData& data);
+	// Calls drawMesh(mesh, shader, bound, local) for every mesh instance,
+	// where shader is shaderFor(mesh), local is the node transform and bound
+	// says whether the model's VAO is bound for the mesh. current is the
+	// program in use, if any; others are made current when a mesh needs them
+	// and get "model" set, as does every program for each node.
+	template <typename ShaderFor, typename F>
+	void forEachInstance(const Shader* current, ShaderFor&& shaderFor,
+		const glm::mat4& modelMatrix, F&& drawMesh) const;
+	// Draws a mesh instance the culler keeps, at the LOD the selector picks
+	static void drawCulledInstance(const Mesh& mesh, const Shader& shader, bool bound,
+		const LodSelector& selector, const MeshletCuller& culler, bool useMaterial);
+
+	// Commands for drawBatched, and the multi-draws that submit them
+	struct MultiDraw {
+		const Material* material;
+		GLenum indexType;
+		int node; // -1 for the model matrix alone
+		size_t first, count; // commands
+	};
+	struct Batches {
+		uint64_t generation = 0;
+		std::vector<DrawElementsIndirectCommand> commands;
+		// For each command, the mesh it draws and its node, or -1
+		std::vector<std::pair<unsigned int, int>> instances;
+		// Merged by material and index type, and by node and quantization too
+		std::vector<MultiDraw> indirectDraws, draws;
+		// The commands as glMultiDrawElementsBaseVertex arguments
+		std::vector<GLsizei> counts;
+		std::vector<const void*> offsets;
+		std::vector<GLint> baseVertices;
+		// Meshes with their own VAO
+		std::vector<std::pair<unsigned int, int>> separate;
+		BufferHandle indirectBuffer;
+		std::vector<InstanceData> instanceData;
+	};
+	Batches& batches() const;
+	template <typename F>
+	void forEachInstance(const Shader& shader, const glm::mat4& modelMatrix,
+		F&& drawMesh) const {
+		forEachInstance(&shader, [&](const Mesh&) -> const Shader& { return shader; },
+			modelMatrix, std::forward<F>(drawMesh));
+	}
 
 public:
 	std::vector<Mesh> meshes;
 	std::vector<Material> materials;
+	std::shared_ptr<GeometryBuffer> geometry;
+	// Empty if node transforms were baked into the meshes
+	std::vector<Node> nodes;
+	// The nodes that instance each mesh
+	std::vector<std::vector<unsigned int>> meshNodes;
+private:
+	NameIndex meshIndex, materialIndex;
+	// Where paged out geometry is read back from
+	fs::path cacheSource;
+	uint64_t cacheKey = 0;
+	mutable std::unique_ptr<Batches> batches_;
 };
 
-inline Model::Model(const fs::path& path, bool forceSmooth, unsigned int flags)
+inline uint64_t ModelOptions::importKey() const
+{
+	uint64_t hash = util::fnv1a_value(flags, util::FNV_OFFSET_BASIS);
+	hash = util::fnv1a_value(forceSmooth, hash);
+	hash = util::fnv1a_value(optimizeMeshes, hash);
+	if (generateLods) {
+		hash = util::fnv1a_value(lod.maxLods, hash);
+		hash = util::fnv1a_value(lod.reduction, hash);
+		hash = util::fnv1a_value(lod.maxError, hash);
+	}
+	hash = util::fnv1a_value(buildMeshlets, hash);
+	return hash;
+}
+
+inline Model::Model(const fs::path& path, const ModelOptions& options)
+{
+	ModelData data;
+	if (loadData(path, data, options)) {
+		TextureLoader loader;
+		build(std::move(data), loader, options);
+		// mesh uploads overlapped the image decoding
+		loader.finish();
+		compileMaterials();
+	}
+}
+
+inline Model::Model(ModelData&& data, TextureLoader* loader, const ModelOptions& options)
+{
+	if (loader) {
+		build(std::move(data), *loader, options);
+	}
+	else {
+		TextureLoader localLoader;
+		build(std::move(data), localLoader, options);
+		localLoader.finish();
+		compileMaterials();
+	}
+}
+
+inline bool Model::loadData(const fs::path& path, ModelData& data,
+	const ModelOptions& options)
+{
+	uint64_t key = options.useCache ? model_cache::sourceKey(path, options.importKey(),
+		obj_loader::materialLibraries(path)) : 0;
+	if (key && model_cache::load(path, key, data)) {
+		data.cacheSource = path;
+		data.cacheKey = key;
+		return true;
+	}
+	if (!importData(path, data, options.forceSmooth, options.flags))
+		return false;
+	if (options.optimizeMeshes)
+		mesh_optimizer::optimize(data);
+	if (options.generateLods)
+		mesh_optimizer::generateLods(data, options.lod);
+	if (options.buildMeshlets) {
+		ThreadPool::shared().parallelFor(data.meshes.size(), [&](size_t i) {
+			mesh_optimizer::buildMeshlets(data.meshes[i]);
+		});
+	}
+	if (key && model_cache::save(path, key, data)) {
+		data.cacheSource = path;
+		data.cacheKey = key;
+	}
+	return true;
+}
+
+inline bool Model::importData(const fs::path& path, ModelData& data,
+	bool forceSmooth, unsigned int flags)
+{
+	// OBJ files with the default flags go through the native loader, with
+	// Assimp as the fallback for anything it doesn't handle
+	if (!forceSmooth && flags == DEFAULT_FLAGS && obj_loader::detail::isObj(path)
+		&& obj_loader::load(path, data))
+		return true;
+	return importAssimp(path, data, forceSmooth, flags);
+}
+
+inline bool Model::importAssimp(const fs::path& path, ModelData& data,
+	bool forceSmooth, unsigned int flags)
 {
 	Assimp::Importer importer;
 	if (forceSmooth) {
@@ -49,49 +288,401 @@ inline Model::Model(const fs::path& path, bool forceSmooth, unsigned int flags)
 	const aiScene* scene = importer.ReadFile(u8::path_to_char(path), flags);
 	if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE) {
 		std::cerr << "ERROR::ASSIMP::" << importer.GetErrorString() << std::endl;
-		return;
+		return false;
 	}
 	fs::path directory = path.parent_path();
-	materials.reserve(scene->mNumMaterials);
+	data.materials.clear();
+	data.meshes.clear();
+	data.materials.reserve(scene->mNumMaterials);
 	for (unsigned int i = 0; i < scene->mNumMaterials; i++) {
-		materials.emplace_back(scene->mMaterials[i], directory);
+		data.materials.emplace_back(scene->mMaterials[i], directory);
+	}
+	data.nodes.clear();
+	if (flags & aiProcess_PreTransformVertices) {
+		processNode(scene->mRootNode, scene, data);
+	}
+	else {
+		data.meshes.reserve(scene->mNumMeshes);
+		for (unsigned int i = 0; i < scene->mNumMeshes; i++) {
+			processMesh(scene->mMeshes[i], data);
+		}
+		processHierarchy(scene->mRootNode, -1, data);
+	}
+	return true;
+}
+
+inline void Model::build(ModelData&& data, TextureLoader& loader, const ModelOptions& options)
+{
+	// Meshes keep pointers into materials, so it must not reallocate
+	materials.reserve(data.materials.size());
+	for (const MaterialData& mat : data.materials) {
+		materials.emplace_back(mat, &loader);
+	}
+	geometry = options.geometry;
+	if (!geometry) {
+		size_t numVertices = 0, indexBytes = 0;
+		bool hasTexCoords = false;
+		for (const MeshData& mesh : data.meshes) {
+			size_t size = indexSize(indexTypeFor(mesh.vertices.size()));
+			numVertices += mesh.vertices.size();
+			// with room for alignment padding
+			indexBytes += (mesh.indices.size() + 1) * size;
+			hasTexCoords |= mesh.hasTexCoords;
+		}
+		VertexFormat format = options.vertexFormat;
+		if (!hasTexCoords)
+			format.texCoords = TexCoordFormat::None;
+		geometry = GeometryBuffer::create(numVertices, indexBytes, format);
+	}
+	meshes.reserve(data.meshes.size());
+	for (MeshData& mesh : data.meshes) {
+		const Material* material = &materials[mesh.materialIndex];
+		meshes.emplace_back(std::move(mesh), material, geometry.get());
+	}
+
+	nodes.reserve(data.nodes.size());
+	meshNodes.resize(meshes.size());
+	for (NodeData& node : data.nodes) {
+		glm::mat4 global = node.parent >= 0
+			? nodes[node.parent].globalTransform * node.transform : node.transform;
+		for (unsigned int mesh : node.meshes)
+			meshNodes[mesh].push_back(unsigned(nodes.size()));
+		nodes.push_back({ std::move(node.name), node.transform, global, node.parent,
+			std::move(node.meshes) });
+	}
+	cacheSource = std::move(data.cacheSource);
+	cacheKey = data.cacheKey;
+	setResidency(options.residency);
+
+	meshIndex = NameIndex(meshes.size(), [&](size_t i) { return meshes[i].name; });
+	materialIndex = NameIndex(materials.size(), [&](size_t i) { return materials[i].name; });
+}
+
+template <typename ShaderFor, typename F>
+void Model::forEachInstance(const Shader* current, ShaderFor&& shaderFor,
+	const glm::mat4& modelMatrix, F&& drawMesh) const
+{
+	// meshes in the model's buffer share its VAO, so it is bound once and
+	// again only after a mesh with buffers of its own unbinds it
+	bool vaoBound = false;
+	bool modelStale = false;
+	auto drawOne = [&](const Mesh& mesh, const glm::mat4& local) {
+		const Shader& shader = shaderFor(mesh);
+		if (&shader != current) {
+			shader.use();
+			current = &shader;
+			modelStale = true;
+		}
+		if (modelStale) {
+			shader.setMat4("model", modelMatrix * local);
+			modelStale = false;
+		}
+		bool bound = geometry && mesh.geometry() == geometry.get();
+		if (bound && !vaoBound)
+			geometry->bind();
+		vaoBound = bound;
+		drawMesh(mesh, shader, bound, local);
+	};
+	if (nodes.empty()) {
+		for (auto& mesh : meshes)
+			drawOne(mesh, glm::mat4(1.0f));
+	}
+	for (const Node& node : nodes) {
+		if (node.meshes.empty())
+			continue;
+		modelStale = true;
+		for (unsigned int index : node.meshes)
+			drawOne(meshes[index], node.globalTransform);
 	}
-	processNode(scene->mRootNode, scene);
 }
 
 inline void Model::draw(const Shader& shader, bool useMaterial) const
 {
-	for (auto& mesh : meshes)
-		mesh.draw(shader, useMaterial);
+	draw(shader, glm::mat4(1.0f), useMaterial);
 }
 
-inline Material* Model::getMaterial(std::string_view name)
+inline void Model::draw(const Shader& shader, const glm::mat4& modelMatrix,
+	bool useMaterial) const
 {
-	for (auto& mat : materials)
-		if (mat.name == name)
-			return &mat;
-	return nullptr;
+	forEachInstance(shader, modelMatrix, [&](const Mesh& mesh, const Shader&, bool bound, const glm::mat4&) {
+		if (bound)
+			mesh.drawBound(shader, useMaterial);
+		else
+			mesh.draw(shader, useMaterial);
+	});
 }
 
-inline Mesh* Model::getMesh(std::string_view name)
+inline void Model::draw(const Shader& shader, const LodSelector& selector,
+	const glm::mat4& modelMatrix, bool useMaterial) const
 {
-	for (auto& mesh : meshes)
-		if (mesh.name == name)
-			return &mesh;
-	return nullptr;
+	forEachInstance(shader, modelMatrix, [&](const Mesh& mesh, const Shader&, bool bound, const glm::mat4& local) {
+		size_t lod = selector.select(mesh, modelMatrix * local);
+		if (bound)
+			mesh.drawBound(shader, useMaterial, lod);
+		else
+			mesh.draw(shader, useMaterial, lod);
+	});
 }
 
-inline void Model::processNode(aiNode* node, const aiScene* scene)
+inline void Model::draw(const Shader& shader, const LodSelector& selector,
+	const MeshletCuller& culler, bool useMaterial) const
+{
+	forEachInstance(shader, culler.modelMatrix(), [&](const Mesh& mesh, const Shader&, bool bound, const glm::mat4& local) {
+		drawCulledInstance(mesh, shader, bound, selector, culler.transformed(local), useMaterial);
+	});
+}
+
+inline void Model::draw(ShaderPermutations& shaders, const ShaderFeatures& lights,
+	const LodSelector& selector, const MeshletCuller& culler) const
+{
+	auto shaderFor = [&](const Mesh& mesh) -> const Shader& {
+		return mesh.material ? mesh.material->selectShader(shaders, lights) : shaders.get(lights);
+	};
+	forEachInstance(nullptr, shaderFor, culler.modelMatrix(),
+		[&](const Mesh& mesh, const Shader& shader, bool bound, const glm::mat4& local) {
+		drawCulledInstance(mesh, shader, bound, selector, culler.transformed(local), true);
+	});
+}
+
+inline void Model::drawCulledInstance(const Mesh& mesh, const Shader& shader, bool bound,
+	const LodSelector& selector, const MeshletCuller& culler, bool useMaterial)
+{
+	if (!culler.visible(mesh.center(), mesh.radius()))
+		return;
+	size_t lod = selector.select(mesh, culler.modelMatrix());
+	if (lod == 0 && bound)
+		mesh.drawCulledBound(shader, culler, useMaterial);
+	else if (lod == 0)
+		mesh.drawCulled(shader, culler, useMaterial);
+	else if (bound)
+		mesh.drawBound(shader, useMaterial, lod);
+	else
+		mesh.draw(shader, useMaterial, lod);
+}
+
+inline Model::Batches& Model::batches() const
+{
+	if (batches_ && (!geometry || batches_->generation == geometry->generation()))
+		return *batches_;
+	batches_ = std::make_unique<Batches>();
+	Batches& b = *batches_;
+	std::vector<std::pair<unsigned int, int>> instances;
+	if (nodes.empty()) {
+		for (unsigned int i = 0; i < meshes.size(); i++)
+			instances.emplace_back(i, -1);
+	}
+	for (int n = 0; n < int(nodes.size()); n++) {
+		for (unsigned int index : nodes[n].meshes)
+			instances.emplace_back(index, n);
+	}
+	for (auto instance : instances) {
+		const Mesh& mesh = meshes[instance.first];
+		if (geometry && mesh.geometry() == geometry.get())
+			b.instances.push_back(instance);
+		else
+			b.separate.push_back(instance);
+	}
+	if (!geometry)
+		return b;
+	b.generation = geometry->generation();
+
+	std::sort(b.instances.begin(), b.instances.end(), [&](auto& x, auto& y) {
+		const Mesh& a = meshes[x.first];
+		const Mesh& c = meshes[y.first];
+		return std::make_tuple(a.material, a.drawIndexType(), x.second, x.first)
+			< std::make_tuple(c.material, c.drawIndexType(), y.second, y.first);
+	});
+	for (size_t i = 0; i < b.instances.size(); i++) {
+		auto [index, node] = b.instances[i];
+		const Mesh& mesh = meshes[index];
+		DrawElementsIndirectCommand command = mesh.indirectCommand();
+		command.baseInstance = GLuint(i);
+		b.commands.push_back(command);
+		b.counts.push_back(GLsizei(command.count));
+		b.offsets.push_back(reinterpret_cast<const void*>(
+			command.firstIndex * indexSize(mesh.drawIndexType())));
+		b.baseVertices.push_back(command.baseVertex);
+
+		const MultiDraw* last = b.indirectDraws.empty() ? nullptr : &b.indirectDraws.back();
+		if (last && last->material == mesh.material && last->indexType == mesh.drawIndexType())
+			b.indirectDraws.back().count++;
+		else
+			b.indirectDraws.push_back({ mesh.material, mesh.drawIndexType(), -1, i, 1 });
+
+		last = b.draws.empty() ? nullptr : &b.draws.back();
+		const VertexQuantization& q = mesh.vertexQuantization();
+		const VertexQuantization* lastQ = last ? &meshes[b.instances[i - 1].first].vertexQuantization() : nullptr;
+		if (last && last->material == mesh.material && last->indexType == mesh.drawIndexType()
+			&& last->node == node && lastQ->offset == q.offset && lastQ->scale == q.scale)
+			b.draws.back().count++;
+		else
+			b.draws.push_back({ mesh.material, mesh.drawIndexType(), node, i, 1 });
+	}
+	if (multiDrawIndirect() && !b.commands.empty()) {
+		b.indirectBuffer = createBuffer();
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, b.indirectBuffer.get());
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, b.commands.size() * sizeof(DrawElementsIndirectCommand),
+			b.commands.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+	return b;
+}
+
+inline void Model::drawBatched(ShaderPermutations& shaders, const ShaderFeatures& lights,
+	const glm::mat4& modelMatrix) const
+{
+	Batches& b = batches();
+	auto shaderFor = [&](const Material* material, const ShaderFeatures& features) -> const Shader& {
+		return material ? material->selectShader(shaders, features) : shaders.get(features);
+	};
+	auto transform = [&](int node) {
+		return node < 0 ? modelMatrix : modelMatrix * nodes[node].globalTransform;
+	};
+
+	for (auto [index, node] : b.separate) {
+		const Mesh& mesh = meshes[index];
+		const Shader& shader = shaderFor(mesh.material, lights);
+		shader.use();
+		shader.setMat4("model", transform(node));
+		mesh.draw(shader);
+	}
+	if (b.commands.empty())
+		return;
+
+	geometry->bind();
+	bool octNormals = geometry->format().normal == NormalFormat::Oct16;
+	if (multiDrawIndirect()) {
+		// Dequantization goes into each draw's matrix, as draws can't have
+		// uniforms of their own
+		b.instanceData.clear();
+		for (auto [index, node] : b.instances) {
+			const VertexQuantization& q = meshes[index].vertexQuantization();
+			glm::mat4 world = transform(node);
+			InstanceData& data = b.instanceData.emplace_back(
+				glm::scale(glm::translate(world, q.offset), q.scale));
+			data.normal = glm::transpose(glm::inverse(glm::mat3(world)));
+		}
+		InstanceBuffer& instanceBuffer = geometry->instanceBuffer();
+		instanceBuffer.upload(b.instanceData);
+		instanceBuffer.attach();
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, b.indirectBuffer.get());
+
+		ShaderFeatures features = lights;
+		features.instanced = true;
+		for (const MultiDraw& draw : b.indirectDraws) {
+			const Shader& shader = shaderFor(draw.material, features);
+			shader.use();
+			shader.setVec3("positionOffset", glm::vec3(0.0f));
+			shader.setVec3("positionScale", glm::vec3(1.0f));
+			shader.setBool("octNormals", octNormals);
+			if (draw.material)
+				MaterialTracker::shared().apply(shader, *draw.material);
+			glMultiDrawElementsIndirect(GL_TRIANGLES, draw.indexType,
+				reinterpret_cast<const void*>(draw.first * sizeof(DrawElementsIndirectCommand)),
+				GLsizei(draw.count), 0);
+		}
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		return;
+	}
+
+	for (const MultiDraw& draw : b.draws) {
+		const Shader& shader = shaderFor(draw.material, lights);
+		const VertexQuantization& q = meshes[b.instances[draw.first].first].vertexQuantization();
+		shader.use();
+		shader.setMat4("model", transform(draw.node));
+		shader.setVec3("positionOffset", q.offset);
+		shader.setVec3("positionScale", q.scale);
+		shader.setBool("octNormals", octNormals);
+		if (draw.material)
+			MaterialTracker::shared().apply(shader, *draw.material);
+		glMultiDrawElementsBaseVertex(GL_TRIANGLES, &b.counts[draw.first], draw.indexType,
+			&b.offsets[draw.first], GLsizei(draw.count), &b.baseVertices[draw.first]);
+	}
+}
+
+inline void Model::compileMaterials()
+{
+	for (Material& material : materials)
+		material.compile();
+}
+
+inline bool Model::setResidency(GeometryResidency residency)
+{
+	if (residency == GeometryResidency::Paged && !cacheKey) {
+		std::cerr << "ERROR::MODEL::NO_CACHE_TO_PAGE_TO: leaving the residency as it is" << std::endl;
+		return false;
+	}
+	bool ok = residency != GeometryResidency::Keep || restoreGeometry();
+	for (Mesh& mesh : meshes)
+		ok = mesh.setResidency(residency) && ok;
+	return ok;
+}
+
+inline bool Model::restoreGeometry()
+{
+	bool paged = std::any_of(meshes.begin(), meshes.end(),
+		[](const Mesh& mesh) { return mesh.residency() == GeometryResidency::Paged; });
+	if (!paged)
+		return true;
+	ModelData data;
+	if (!model_cache::load(cacheSource, cacheKey, data) || data.meshes.size() != meshes.size()) {
+		std::cerr << "ERROR::MODEL::CACHE_CHANGED: " << cacheSource << std::endl;
+		return false;
+	}
+	for (size_t i = 0; i < meshes.size(); i++) {
+		if (meshes[i].residency() == GeometryResidency::Paged) {
+			meshes[i].restoreGeometry(std::move(data.meshes[i].vertices),
+				std::move(data.meshes[i].indices));
+		}
+	}
+	return true;
+}
+
+inline GeometryMemory Model::geometryMemory() const
+{
+	GeometryMemory memory;
+	for (const Mesh& mesh : meshes)
+		memory += mesh.memory();
+	return memory;
+}
+
+inline Material* Model::getMaterial(const NameKey& key)
+{
+	uint32_t i = materialIndex.find(key);
+	return i == NameIndex::NOT_FOUND ? nullptr : &materials[i];
+}
+
+inline Mesh* Model::getMesh(const NameKey& key)
+{
+	uint32_t i = meshIndex.find(key);
+	return i == NameIndex::NOT_FOUND ? nullptr : &meshes[i];
+}
+
+inline void Model::processNode(aiNode* node, const aiScene* scene, ModelData& data)
 {
 	for (unsigned int i = 0; i < node->mNumMeshes; i++) {
-		processMesh(scene->mMeshes[node->mMeshes[i]]);
+		processMesh(scene->mMeshes[node->mMeshes[i]], data);
 	}
 	for (unsigned int i = 0; i < node->mNumChildren; i++) {
-		processNode(node->mChildren[i], scene);
+		processNode(node->mChildren[i], scene, data);
 	}
 }
 
-inline void Model::processMesh(aiMesh* mesh)
+inline void Model::processHierarchy(aiNode* node, int parent, ModelData& data)
+{
+	int index = int(data.nodes.size());
+	NodeData& n = data.nodes.emplace_back();
+	n.name = node->mName.C_Str();
+	// aiMatrix4x4 is row-major
+	n.transform = glm::transpose(glm::make_mat4(&node->mTransformation.a1));
+	n.parent = parent;
+	n.meshes.assign(node->mMeshes, node->mMeshes + node->mNumMeshes);
+	for (unsigned int i = 0; i < node->mNumChildren; i++) {
+		processHierarchy(node->mChildren[i], index, data);
+	}
+}
+
+inline void Model::processMesh(aiMesh* mesh, ModelData& data)
 {
 	std::vector<Vertex> vertices;
 	for (unsigned int i = 0; i < mesh->mNumVertices; i++) {
@@ -115,8 +706,6 @@ inline void Model::processMesh(aiMesh* mesh)
 		}
 	}
 
-	const char* name = mesh->mName.C_Str();
-	const Material& material = materials[mesh->mMaterialIndex];
-
-	meshes.emplace_back(name, std::move(vertices), std::move(indices), &material);
+	data.meshes.push_back({ mesh->mName.C_Str(), std::move(vertices),
+		std::move(indices), mesh->mMaterialIndex, mesh->HasTextureCoords(0) });
 }
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <system_error>
+
+#include "model_data.h"
+#include "mapped_file.h"
+#include "utils.h"
+#include "u8tils.h"
+
+namespace fs = std::filesystem;
+
+// Binary cache of imported model data, stored next to the source model.
+// The cache is keyed by a hash of the source file contents, the files it
+// references and the import flags, so it is invalidated whenever any of them
+// changes.
+namespace model_cache {
+
+constexpr uint32_t MAGIC = 0x434c444d; // "MDLC"
+constexpr uint32_t VERSION = 5;
+constexpr const char* EXTENSION = ".mcache";
+// Sanity limit for reading
+constexpr uint32_t MAX_LODS = 32;
+
+struct Header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint32_t numMaterials;
+	uint32_t numMeshes;
+	uint32_t numNodes;
+};
+
+inline fs::path cachePath(const fs::path& source) {
+	fs::path path = source;
+	path += EXTENSION;
+	return path;
+}
+
+// Settings is a hash of whatever else affects the imported data, and
+// dependencies are the other files the import reads, such as OBJ material
+// libraries; a missing dependency hashes differently from any contents.
+// Returns 0 if the source file can't be read.
+inline uint64_t sourceKey(const fs::path& source, uint64_t settings,
+	const std::vector<fs::path>& dependencies = {}) {
+	MappedFile file(source);
+	if (!file)
+		return 0;
+	uint64_t hash = util::fnv1a(file.data(), file.size());
+	for (const fs::path& dependency : dependencies) {
+		MappedFile dep(dependency);
+		hash = util::fnv1a_value(uint8_t(bool(dep)), hash);
+		if (dep)
+			hash = util::fnv1a(dep.data(), dep.size(), hash);
+	}
+	hash = util::fnv1a_value(VERSION, hash);
+	hash = util::fnv1a_value(uint32_t(sizeof(Vertex)), hash);
+	hash = util::fnv1a_value(settings, hash);
+	return hash;
+}
+
+namespace detail {
+
+class Reader {
+public:
+	Reader(const unsigned char* data, size_t size) : p(data), end(data + size) {}
+	bool ok() const { return good; }
+
+	void read(void* out, size_t size) {
+		if (!good || size_t(end - p) < size) {
+			good = false;
+			return;
+		}
+		std::memcpy(out, p, size);
+		p += size;
+	}
+	template <typename T>
+	T read() {
+		T value{};
+		read(&value, sizeof(T));
+		return value;
+	}
+	std::string readString() {
+		uint32_t size = read<uint32_t>();
+		if (!good || size_t(end - p) < size) {
+			good = false;
+			return std::string();
+		}
+		std::string s(reinterpret_cast<const char*>(p), size);
+		p += size;
+		return s;
+	}
+	template <typename T>
+	void readVector(std::vector<T>& out) {
+		uint32_t count = read<uint32_t>();
+		if (!good || size_t(end - p) / sizeof(T) < count) {
+			good = false;
+			return;
+		}
+		out.resize(count);
+		read(out.data(), count * sizeof(T));
+	}
+
+private:
+	const unsigned char* p;
+	const unsigned char* end;
+	bool good = true;
+};
+
+class Writer {
+public:
+	void write(const void* data, size_t size) {
+		auto bytes = static_cast<const unsigned char*>(data);
+		buffer.insert(buffer.end(), bytes, bytes + size);
+	}
+	template <typename T>
+	void write(const T& value) {
+		write(&value, sizeof(T));
+	}
+	void writeString(std::string_view s) {
+		write(uint32_t(s.size()));
+		write(s.data(), s.size());
+	}
+	template <typename T>
+	void writeVector(const std::vector<T>& v) {
+		write(uint32_t(v.size()));
+		write(v.data(), v.size() * sizeof(T));
+	}
+
+	std::vector<unsigned char> buffer;
+};
+
+// Texture paths are stored relative to the model directory
+inline void writePath(Writer& w, const fs::path& path, const fs::path& directory) {
+	if (path.empty())
+		w.writeString("");
+	else
+		w.writeString(u8::path_to_string(path.lexically_relative(directory)));
+}
+
+inline fs::path readPath(Reader& r, const fs::path& directory) {
+	std::string s = r.readString();
+	if (s.empty())
+		return fs::path();
+	return directory / u8::to_path(s);
+}
+
+}
+
+inline bool load(const fs::path& source, uint64_t key, ModelData& data) {
+	MappedFile file(cachePath(source));
+	if (!file)
+		return false;
+	detail::Reader r(file.data(), file.size());
+	Header header = r.read<Header>();
+	if (!r.ok() || header.magic != MAGIC || header.version != VERSION || header.key != key)
+		return false;
+
+	fs::path directory = source.parent_path();
+	ModelData result;
+	result.materials.resize(header.numMaterials);
+	for (MaterialData& mat : result.materials) {
+		mat.name = r.readString();
+		mat.shininess = r.read<float>();
+		mat.diffuse_color = r.read<glm::vec3>();
+		mat.specular_color = r.read<glm::vec3>();
+		mat.ambient_color = r.read<glm::vec3>();
+		mat.emissive_color = r.read<glm::vec3>();
+		mat.diffuse_texture = detail::readPath(r, directory);
+		mat.specular_texture = detail::readPath(r, directory);
+		mat.ambient_texture = detail::readPath(r, directory);
+		mat.emissive_texture = detail::readPath(r, directory);
+		mat.ao_texture = detail::readPath(r, directory);
+		mat.normal_texture = detail::readPath(r, directory);
+	}
+	result.meshes.resize(header.numMeshes);
+	for (MeshData& mesh : result.meshes) {
+		mesh.name = r.readString();
+		mesh.materialIndex = r.read<uint32_t>();
+		mesh.hasTexCoords = r.read<uint8_t>() != 0;
+		r.readVector(mesh.vertices);
+		r.readVector(mesh.indices);
+		uint32_t numLods = r.read<uint32_t>();
+		if (!r.ok() || numLods > MAX_LODS)
+			return false;
+		mesh.lods.resize(numLods);
+		for (MeshLod& lod : mesh.lods) {
+			r.readVector(lod.indices);
+			lod.error = r.read<float>();
+		}
+		r.readVector(mesh.meshlets);
+		if (r.ok() && mesh.materialIndex >= header.numMaterials)
+			return false;
+	}
+	result.nodes.resize(header.numNodes);
+	for (size_t i = 0; i < result.nodes.size(); i++) {
+		NodeData& node = result.nodes[i];
+		node.name = r.readString();
+		node.transform = r.read<glm::mat4>();
+		node.parent = r.read<int32_t>();
+		r.readVector(node.meshes);
+		if (!r.ok() || node.parent >= int(i))
+			return false;
+		for (unsigned int mesh : node.meshes) {
+			if (mesh >= header.numMeshes)
+				return false;
+		}
+	}
+	if (!r.ok())
+		return false;
+	data = std::move(result);
+	return true;
+}
+
+inline bool save(const fs::path& source, uint64_t key, const ModelData& data) {
+	detail::Writer w;
+	w.write(Header{ MAGIC, VERSION, key,
+		uint32_t(data.materials.size()), uint32_t(data.meshes.size()),
+		uint32_t(data.nodes.size()) });
+
+	fs::path directory = source.parent_path();
+	for (const MaterialData& mat : data.materials) {
+		w.writeString(mat.name);
+		w.write(mat.shininess);
+		w.write(mat.diffuse_color);
+		w.write(mat.specular_color);
+		w.write(mat.ambient_color);
+		w.write(mat.emissive_color);
+		detail::writePath(w, mat.diffuse_texture, directory);
+		detail::writePath(w, mat.specular_texture, directory);
+		detail::writePath(w, mat.ambient_texture, directory);
+		detail::writePath(w, mat.emissive_texture, directory);
+		detail::writePath(w, mat.ao_texture, directory);
+		detail::writePath(w, mat.normal_texture, directory);
+	}
+	for (const MeshData& mesh : data.meshes) {
+		w.writeString(mesh.name);
+		w.write(uint32_t(mesh.materialIndex));
+		w.write(uint8_t(mesh.hasTexCoords));
+		w.writeVector(mesh.vertices);
+		w.writeVector(mesh.indices);
+		w.write(uint32_t(mesh.lods.size()));
+		for (const MeshLod& lod : mesh.lods) {
+			w.writeVector(lod.indices);
+			w.write(lod.error);
+		}
+		w.writeVector(mesh.meshlets);
+	}
+	for (const NodeData& node : data.nodes) {
+		w.writeString(node.name);
+		w.write(node.transform);
+		w.write(int32_t(node.parent));
+		w.writeVector(node.meshes);
+	}
+
+	// Write to a temporary file first so a partial write never looks valid
+	fs::path path = cachePath(source);
+	fs::path tmpPath = path;
+	tmpPath += ".tmp";
+	{
+		std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char*>(w.buffer.data()), w.buffer.size());
+		if (!out) {
+			std::cerr << "ERROR::MODEL_CACHE::Failed to write " << tmpPath << std::endl;
+			return false;
+		}
+	}
+	std::error_code ec;
+	fs::rename(tmpPath, path, ec);
+	if (ec) {
+		std::cerr << "ERROR::MODEL_CACHE::Failed to write " << path << ": " << ec.message() << std::endl;
+		fs::remove(tmpPath, ec);
+		return false;
+	}
+	return true;
+}
+
+}
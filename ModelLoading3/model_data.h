@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "material.h"
+#include "mesh.h"
+
+// A node of the scene hierarchy. Parents come before their children.
+struct NodeData
+{
+	std::string name;
+	glm::mat4 transform = glm::mat4(1.0f); // relative to the parent
+	int parent = -1;
+	std::vector<unsigned int> meshes;
+};
+
+// CPU-side result of importing a model, before anything is uploaded to the GPU
+struct ModelData
+{
+	std::vector<MaterialData> materials;
+	std::vector<MeshData> meshes;
+	// Empty when node transforms were baked into the meshes
+	std::vector<NodeData> nodes;
+	// Where the model cache holds this data, if it does; set by
+	// Model::loadData and not stored in the cache itself
+	std::filesystem::path cacheSource;
+	uint64_t cacheKey = 0;
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <stop_token>
+
+#include "async.h"
+#include "model.h"
+#include "texture_loader.h"
+#include "thread_pool.h"
+
+namespace fs = std::filesystem;
+
+// Loads a model without blocking the render loop. Import (or the cache read)
+// and image decoding run on the thread pool. GL uploads run on the main
+// thread inside MainThreadQueue::poll(), with at most texturesPerFrame
+// texture uploads per frame. Returns nullptr if the model can't be loaded.
+// Once stop is requested the load ends as soon as it can: it returns nullptr
+// if the model isn't built yet, and otherwise uploads the rest at once.
+inline Task<std::unique_ptr<Model>> loadModel(fs::path path, ModelOptions options = {},
+	size_t texturesPerFrame = 2, std::stop_token stop = {})
+{
+	co_await switchTo(ThreadPool::shared());
+	ModelData data;
+	bool loaded = false;
+	try {
+		loaded = Model::loadData(path, data, options);
+	}
+	catch (const std::exception& e) {
+		std::cerr << "ERROR::MODEL_LOADER::Failed to load " << path << ": " << e.what() << std::endl;
+	}
+
+	co_await switchToMainThread();
+	if (!loaded || stop.stop_requested())
+		co_return nullptr;
+	TextureLoader loader;
+	std::unique_ptr<Model> model;
+	try {
+		model = std::make_unique<Model>(std::move(data), &loader, options);
+	}
+	catch (const std::exception& e) {
+		std::cerr << "ERROR::MODEL_LOADER::Failed to build " << path << ": " << e.what() << std::endl;
+	}
+	while (loader.pending()) {
+		co_await switchToMainThread();
+		if (stop.stop_requested())
+			loader.finish();
+		else if (loader.uploadReady(texturesPerFrame) == 0)
+			continue;
+		if (model)
+			model->compileMaterials();
+	}
+	co_return model;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "utils.h"
+
+// A name with its hash, which can be computed once (or at compile time) and
+// reused for every lookup
+struct NameKey
+{
+	std::string_view name;
+	uint64_t hash;
+
+	constexpr NameKey(std::string_view name) : name(name), hash(util::fnv1a(name)) {}
+	constexpr NameKey(std::string_view name, uint64_t hash) : name(name), hash(hash) {}
+};
+
+// Maps names to positions in a container. The names are interned into one
+// buffer when the index is built, and lookups probe an open addressing table
+// without allocating. For duplicate names the first position wins.
+class NameIndex
+{
+public:
+	static constexpr uint32_t NOT_FOUND = UINT32_MAX;
+
+	NameIndex() = default;
+	// getName(i) returns the name of element i as something convertible to
+	// std::string_view
+	template <typename GetName>
+	NameIndex(size_t count, GetName&& getName);
+
+	uint32_t find(std::string_view name) const { return find(NameKey(name)); }
+	uint32_t find(const NameKey& key) const;
+	size_t size() const { return entries.size(); }
+
+private:
+	struct Entry {
+		uint64_t hash;
+		uint32_t offset, length; // into names
+	};
+	struct Slot {
+		uint64_t hash = 0;
+		uint32_t index = NOT_FOUND;
+	};
+
+	std::string names;
+	std::vector<Entry> entries;
+	std::vector<Slot> slots;
+	size_t mask = 0;
+};
+
+template <typename GetName>
+inline NameIndex::NameIndex(size_t count, GetName&& getName)
+{
+	entries.reserve(count);
+	for (size_t i = 0; i < count; i++) {
+		std::string_view name = getName(i);
+		entries.push_back({ util::fnv1a(name), uint32_t(names.size()), uint32_t(name.size()) });
+		names += name;
+	}
+
+	// at most half full, so probe sequences stay short
+	size_t capacity = 1;
+	while (capacity < count * 2)
+		capacity *= 2;
+	slots.resize(capacity);
+	mask = capacity - 1;
+	for (uint32_t i = 0; i < entries.size(); i++) {
+		if (find(NameKey(std::string_view(names).substr(entries[i].offset, entries[i].length),
+			entries[i].hash)) != NOT_FOUND)
+			continue;
+		size_t slot = entries[i].hash & mask;
+		while (slots[slot].index != NOT_FOUND)
+			slot = (slot + 1) & mask;
+		slots[slot] = { entries[i].hash, i };
+	}
+}
+
+inline uint32_t NameIndex::find(const NameKey& key) const
+{
+	if (slots.empty())
+		return NOT_FOUND;
+	for (size_t slot = key.hash & mask; slots[slot].index != NOT_FOUND; slot = (slot + 1) & mask) {
+		if (slots[slot].hash != key.hash)
+			continue;
+		const Entry& e = entries[slots[slot].index];
+		if (std::string_view(names).substr(e.offset, e.length) == key.name)
+			return slots[slot].index;
+	}
+	return NOT_FOUND;
+}
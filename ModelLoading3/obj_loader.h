@@ -0,0 +1,476 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <climits>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "mapped_file.h"
+#include "model_data.h"
+#include "thread_pool.h"
+#include "u8tils.h"
+
+namespace fs = std::filesystem;
+
+// Wavefront OBJ/MTL reader producing the same ModelData as importing with
+// Assimp and DEFAULT_FLAGS. The file is parsed in parallel chunks and the
+// per-material meshes are welded in parallel. load() returns false for
+// anything it doesn't handle (such as faces without normals), so the caller
+// can fall back to Assimp.
+namespace obj_loader {
+
+namespace detail {
+
+constexpr int32_t MISSING = INT32_MIN;
+constexpr size_t MIN_CHUNK_SIZE = 256 * 1024;
+
+// Index of one face corner. Non-negative values are absolute (0-based);
+// other values encode -(i + 1) for index i relative to the chunk.
+struct Corner {
+	int32_t v, vt, vn;
+	bool operator==(const Corner&) const = default;
+};
+
+struct StateChange {
+	enum Kind { Object, Material } kind;
+	size_t triangle;
+	std::string name;
+};
+
+struct Chunk {
+	std::string_view text;
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> normals;
+	std::vector<glm::vec2> texCoords;
+	std::vector<Corner> corners;
+	std::vector<StateChange> changes;
+	std::vector<std::string> mtllibs;
+	bool ok = true;
+};
+
+inline bool isObj(const fs::path& path) {
+	std::string ext = u8::path_to_string(path.extension());
+	std::transform(ext.begin(), ext.end(), ext.begin(),
+		[](char c) { return char(std::tolower(static_cast<unsigned char>(c))); });
+	return ext == ".obj";
+}
+
+inline bool isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline void skipSpace(const char*& p, const char* end) {
+	while (p < end && isSpace(*p))
+		p++;
+}
+
+inline bool parseFloat(const char*& p, const char* end, float& out) {
+	skipSpace(p, end);
+	if (p < end && *p == '+')
+		p++;
+	auto [next, ec] = std::from_chars(p, end, out);
+	if (ec != std::errc())
+		return false;
+	p = next;
+	return true;
+}
+
+inline bool parseInt(const char*& p, const char* end, int32_t& out) {
+	if (p < end && *p == '+')
+		p++;
+	auto [next, ec] = std::from_chars(p, end, out);
+	if (ec != std::errc())
+		return false;
+	p = next;
+	return true;
+}
+
+// Converts a 1-based OBJ index, negative meaning relative to the end
+inline bool encodeIndex(int32_t index, size_t localCount, int32_t& out) {
+	if (index > 0) {
+		out = index - 1;
+		return true;
+	}
+	if (index < 0 && size_t(-int64_t(index)) <= localCount) {
+		out = -int32_t(int64_t(localCount) + index) - 1;
+		return true;
+	}
+	return false;
+}
+
+inline bool parseCorner(const char*& p, const char* end, const Chunk& chunk, Corner& out) {
+	int32_t index;
+	out = { MISSING, MISSING, MISSING };
+	if (!parseInt(p, end, index) || !encodeIndex(index, chunk.positions.size(), out.v))
+		return false;
+	if (p < end && *p == '/') {
+		p++;
+		if (p < end && *p != '/') {
+			if (!parseInt(p, end, index) || !encodeIndex(index, chunk.texCoords.size(), out.vt))
+				return false;
+		}
+		if (p < end && *p == '/') {
+			p++;
+			if (!parseInt(p, end, index) || !encodeIndex(index, chunk.normals.size(), out.vn))
+				return false;
+		}
+	}
+	return true;
+}
+
+inline std::string_view restOfLine(const char* p, const char* end) {
+	skipSpace(p, end);
+	while (end > p && isSpace(end[-1]))
+		end--;
+	return std::string_view(p, end - p);
+}
+
+inline void parseChunk(Chunk& chunk) {
+	const char* p = chunk.text.data();
+	const char* end = p + chunk.text.size();
+	std::vector<Corner> face;
+	while (p < end && chunk.ok) {
+		const char* lineEnd = std::find(p, end, '\n');
+		skipSpace(p, lineEnd);
+		if (p == lineEnd || *p == '#') {
+			p = lineEnd + (lineEnd < end);
+			continue;
+		}
+		const char* keyEnd = p;
+		while (keyEnd < lineEnd && !isSpace(*keyEnd))
+			keyEnd++;
+		std::string_view key(p, keyEnd - p);
+		p = keyEnd;
+
+		if (key == "v") {
+			glm::vec3 v;
+			chunk.ok = parseFloat(p, lineEnd, v.x) && parseFloat(p, lineEnd, v.y)
+				&& parseFloat(p, lineEnd, v.z);
+			chunk.positions.push_back(v);
+		}
+		else if (key == "vn") {
+			glm::vec3 n;
+			chunk.ok = parseFloat(p, lineEnd, n.x) && parseFloat(p, lineEnd, n.y)
+				&& parseFloat(p, lineEnd, n.z);
+			chunk.normals.push_back(n);
+		}
+		else if (key == "vt") {
+			glm::vec2 t;
+			chunk.ok = parseFloat(p, lineEnd, t.x) && parseFloat(p, lineEnd, t.y);
+			chunk.texCoords.push_back(t);
+		}
+		else if (key == "f") {
+			face.clear();
+			while (chunk.ok) {
+				skipSpace(p, lineEnd);
+				if (p == lineEnd)
+					break;
+				Corner corner;
+				chunk.ok = parseCorner(p, lineEnd, chunk, corner);
+				// Faces without normals would need generated ones
+				chunk.ok = chunk.ok && corner.vn != MISSING;
+				face.push_back(corner);
+			}
+			chunk.ok = chunk.ok && face.size() >= 3;
+			// triangulate as a fan
+			for (size_t i = 2; chunk.ok && i < face.size(); i++) {
+				chunk.corners.push_back(face[0]);
+				chunk.corners.push_back(face[i - 1]);
+				chunk.corners.push_back(face[i]);
+			}
+		}
+		else if (key == "o" || key == "g") {
+			chunk.changes.push_back({ StateChange::Object, chunk.corners.size() / 3,
+				std::string(restOfLine(p, lineEnd)) });
+		}
+		else if (key == "usemtl") {
+			chunk.changes.push_back({ StateChange::Material, chunk.corners.size() / 3,
+				std::string(restOfLine(p, lineEnd)) });
+		}
+		else if (key == "mtllib") {
+			chunk.mtllibs.emplace_back(restOfLine(p, lineEnd));
+		}
+		// anything else (s, l, p, curves, ...) is ignored
+		p = lineEnd + (lineEnd < end);
+	}
+}
+
+inline bool parseColor(const char* p, const char* end, glm::vec3& out) {
+	if (!parseFloat(p, end, out.r))
+		return false;
+	// a single value sets all three channels
+	if (!parseFloat(p, end, out.g))
+		out.g = out.b = out.r;
+	else if (!parseFloat(p, end, out.b))
+		return false;
+	return true;
+}
+
+// Texture statements may carry options such as "-bm 1.0", so the file name
+// is taken to be the last token
+inline std::string_view textureName(std::string_view rest) {
+	size_t pos = rest.find_last_of(" \t");
+	return pos == std::string_view::npos ? rest : rest.substr(pos + 1);
+}
+
+inline MaterialData defaultMaterial() {
+	MaterialData mat;
+	mat.name = "DefaultMaterial";
+	mat.diffuse_color = glm::vec3(0.6f);
+	mat.ambient_color = glm::vec3(0.0f);
+	return mat;
+}
+
+inline bool loadMtl(const fs::path& path, std::vector<MaterialData>& materials) {
+	MappedFile file(path);
+	if (!file) {
+		std::cerr << "ERROR::OBJ_LOADER::Failed to open material library " << path << std::endl;
+		return false;
+	}
+	fs::path directory = path.parent_path();
+	const char* p = reinterpret_cast<const char*>(file.data());
+	const char* end = p + file.size();
+	MaterialData* mat = nullptr;
+	while (p < end) {
+		const char* lineEnd = std::find(p, end, '\n');
+		skipSpace(p, lineEnd);
+		const char* keyEnd = p;
+		while (keyEnd < lineEnd && !isSpace(*keyEnd))
+			keyEnd++;
+		std::string key(p, keyEnd);
+		std::transform(key.begin(), key.end(), key.begin(),
+			[](char c) { return char(std::tolower(static_cast<unsigned char>(c))); });
+		std::string_view rest = restOfLine(keyEnd, lineEnd);
+
+		if (key == "newmtl") {
+			// Assimp's defaults for OBJ materials
+			materials.push_back(defaultMaterial());
+			mat = &materials.back();
+			mat->name = rest;
+		}
+		else if (mat) {
+			const char* r = rest.data();
+			const char* rEnd = r + rest.size();
+			if (key == "ns")
+				parseFloat(r, rEnd, mat->shininess);
+			else if (key == "kd")
+				parseColor(r, rEnd, mat->diffuse_color);
+			else if (key == "ks")
+				parseColor(r, rEnd, mat->specular_color);
+			else if (key == "ka")
+				parseColor(r, rEnd, mat->ambient_color);
+			else if (key == "ke")
+				parseColor(r, rEnd, mat->emissive_color);
+			else if (key == "map_kd")
+				mat->diffuse_texture = MaterialData::resolveTexture(directory, textureName(rest));
+			else if (key == "map_ks")
+				mat->specular_texture = MaterialData::resolveTexture(directory, textureName(rest));
+			else if (key == "map_ka")
+				mat->ambient_texture = MaterialData::resolveTexture(directory, textureName(rest));
+			else if (key == "map_ke")
+				mat->emissive_texture = MaterialData::resolveTexture(directory, textureName(rest));
+			else if (key == "norm" || key == "map_kn")
+				mat->normal_texture = MaterialData::resolveTexture(directory, textureName(rest));
+		}
+		p = lineEnd + (lineEnd < end);
+	}
+	return true;
+}
+
+// Resolves a corner index against the chunk's base offset and checks bounds
+inline bool resolveIndex(int32_t& index, size_t base, size_t total) {
+	if (index == MISSING)
+		return true;
+	int64_t absolute = index >= 0 ? index : int64_t(base) - index - 1;
+	if (absolute >= int64_t(total))
+		return false;
+	index = int32_t(absolute);
+	return true;
+}
+
+struct CornerHash {
+	size_t operator()(const Corner& c) const {
+		uint64_t h = uint32_t(c.v);
+		h = h * 0x9E3779B97F4A7C15ull ^ uint32_t(c.vt);
+		h = h * 0x9E3779B97F4A7C15ull ^ uint32_t(c.vn);
+		return size_t(h ^ (h >> 29));
+	}
+};
+
+}
+
+inline bool load(const fs::path& path, ModelData& data, ThreadPool& pool = ThreadPool::shared()) {
+	using namespace detail;
+	MappedFile file(path);
+	if (!file)
+		return false;
+	std::string_view text(reinterpret_cast<const char*>(file.data()), file.size());
+
+	// Split at line boundaries into chunks for the workers
+	size_t numChunks = std::clamp(text.size() / MIN_CHUNK_SIZE, size_t(1), pool.size() * 4);
+	std::vector<Chunk> chunks(numChunks);
+	size_t start = 0;
+	for (size_t i = 0; i < numChunks; i++) {
+		size_t end = (i + 1 == numChunks) ? text.size() : text.size() * (i + 1) / numChunks;
+		end = std::max(end, start);
+		if (end < text.size()) {
+			size_t newline = text.find('\n', end);
+			end = newline == std::string_view::npos ? text.size() : newline + 1;
+		}
+		chunks[i].text = text.substr(start, end - start);
+		start = end;
+	}
+	pool.parallelFor(numChunks, [&](size_t i) { parseChunk(chunks[i]); });
+
+	// Concatenate the vertex attribute streams
+	std::vector<glm::vec3> positions, normals;
+	std::vector<glm::vec2> texCoords;
+	std::vector<size_t> positionBase, normalBase, texCoordBase;
+	for (Chunk& chunk : chunks) {
+		if (!chunk.ok)
+			return false;
+		positionBase.push_back(positions.size());
+		normalBase.push_back(normals.size());
+		texCoordBase.push_back(texCoords.size());
+		positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+		normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+		texCoords.insert(texCoords.end(), chunk.texCoords.begin(), chunk.texCoords.end());
+	}
+	pool.parallelFor(numChunks, [&](size_t i) {
+		for (Corner& c : chunks[i].corners) {
+			if (!resolveIndex(c.v, positionBase[i], positions.size())
+				|| !resolveIndex(c.vt, texCoordBase[i], texCoords.size())
+				|| !resolveIndex(c.vn, normalBase[i], normals.size()))
+				chunks[i].ok = false;
+		}
+	});
+	for (Chunk& chunk : chunks) {
+		if (!chunk.ok)
+			return false;
+	}
+	if (positions.empty())
+		return false;
+
+	// Materials, in library order
+	ModelData result;
+	fs::path directory = path.parent_path();
+	for (Chunk& chunk : chunks) {
+		for (auto& lib : chunk.mtllibs)
+			loadMtl(directory / u8::to_path(lib), result.materials);
+	}
+	std::unordered_map<std::string, unsigned int> materialIndex;
+	for (unsigned int i = 0; i < result.materials.size(); i++)
+		materialIndex.emplace(result.materials[i].name, i);
+
+	// Group triangles into one mesh per material, like PreTransformVertices,
+	// naming each mesh after the first object that uses the material
+	std::vector<std::vector<Corner>> groups;
+	std::vector<int> meshOfMaterial;
+	std::string objectName;
+	unsigned int currentMaterial = UINT_MAX;
+	auto findMaterial = [&](const std::string& name) {
+		auto it = materialIndex.find(name);
+		if (it != materialIndex.end())
+			return it->second;
+		// unknown or missing materials use the default material
+		auto def = materialIndex.find(defaultMaterial().name);
+		if (def != materialIndex.end())
+			return def->second;
+		result.materials.push_back(defaultMaterial());
+		unsigned int index = unsigned(result.materials.size() - 1);
+		materialIndex.emplace(result.materials.back().name, index);
+		return index;
+	};
+	for (Chunk& chunk : chunks) {
+		size_t numTriangles = chunk.corners.size() / 3;
+		size_t change = 0;
+		size_t tri = 0;
+		while (tri < numTriangles || change < chunk.changes.size()) {
+			// apply state changes that happen before this triangle
+			while (change < chunk.changes.size() && chunk.changes[change].triangle == tri) {
+				StateChange& sc = chunk.changes[change++];
+				if (sc.kind == StateChange::Object)
+					objectName = sc.name;
+				else
+					currentMaterial = findMaterial(sc.name);
+			}
+			size_t next = change < chunk.changes.size() ? chunk.changes[change].triangle : numTriangles;
+			if (next == tri)
+				continue;
+			if (currentMaterial == UINT_MAX)
+				currentMaterial = findMaterial(defaultMaterial().name);
+			if (meshOfMaterial.size() <= currentMaterial)
+				meshOfMaterial.resize(currentMaterial + 1, -1);
+			if (meshOfMaterial[currentMaterial] < 0) {
+				meshOfMaterial[currentMaterial] = int(groups.size());
+				groups.emplace_back();
+				result.meshes.push_back({ objectName, {}, {}, currentMaterial });
+			}
+			auto& group = groups[meshOfMaterial[currentMaterial]];
+			group.insert(group.end(), chunk.corners.begin() + tri * 3, chunk.corners.begin() + next * 3);
+			tri = next;
+		}
+	}
+
+	// Weld identical corners into shared vertices
+	pool.parallelFor(groups.size(), [&](size_t i) {
+		const std::vector<Corner>& corners = groups[i];
+		MeshData& mesh = result.meshes[i];
+		std::unordered_map<Corner, unsigned int, CornerHash> welded;
+		welded.reserve(corners.size());
+		mesh.indices.reserve(corners.size());
+		mesh.hasTexCoords = false;
+		for (const Corner& c : corners) {
+			auto [it, inserted] = welded.try_emplace(c, unsigned(mesh.vertices.size()));
+			if (inserted) {
+				Vertex vertex{};
+				vertex.position = positions[c.v];
+				vertex.normal = normals[c.vn];
+				if (c.vt != MISSING) {
+					vertex.texCoords = texCoords[c.vt];
+					mesh.hasTexCoords = true;
+				}
+				mesh.vertices.push_back(vertex);
+			}
+			mesh.indices.push_back(it->second);
+		}
+	});
+
+	data = std::move(result);
+	return true;
+}
+
+// The material libraries an OBJ file references, resolved like load() does,
+// so callers can tell when they change. Empty for other files.
+inline std::vector<fs::path> materialLibraries(const fs::path& path) {
+	using namespace detail;
+	std::vector<fs::path> libraries;
+	if (!isObj(path))
+		return libraries;
+	MappedFile file(path);
+	if (!file)
+		return libraries;
+	fs::path directory = path.parent_path();
+	const char* p = reinterpret_cast<const char*>(file.data());
+	const char* end = p + file.size();
+	while (p < end) {
+		const char* lineEnd = std::find(p, end, '\n');
+		skipSpace(p, lineEnd);
+		std::string_view line(p, lineEnd - p);
+		if (line.starts_with("mtllib") && line.size() > 6 && isSpace(line[6]))
+			libraries.push_back(directory / u8::to_path(restOfLine(p + 6, lineEnd)));
+		p = lineEnd + (lineEnd < end);
+	}
+	return libraries;
+}
+
+}
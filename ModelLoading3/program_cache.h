@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <glad/glad.h>
+
+#include "mapped_file.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+// On-disk cache of linked program binaries (GL 4.1 program binaries). Entries
+// are keyed by a hash of the shader sources and the driver's vendor,
+// renderer and version strings, since binaries are only valid for the driver
+// that produced them. Use from the GL context thread.
+namespace program_cache {
+
+constexpr uint32_t MAGIC = 0x42475250; // "PRGB"
+constexpr uint32_t VERSION = 1;
+
+struct Header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint32_t format;
+	uint32_t size;
+};
+
+// Whether the context can save and load program binaries at all
+inline bool supported() {
+	static const bool result = [] {
+		if (!GLAD_GL_VERSION_4_1 || !glProgramBinary || !glGetProgramBinary)
+			return false;
+		GLint formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		return formats > 0;
+	}();
+	return result;
+}
+
+inline uint64_t driverKey() {
+	static const uint64_t key = [] {
+		uint64_t hash = util::FNV_OFFSET_BASIS;
+		for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+			auto s = reinterpret_cast<const char*>(glGetString(name));
+			hash = util::fnv1a(s ? std::string_view(s) : std::string_view(), hash);
+			hash = util::fnv1a_value('\0', hash);
+		}
+		return hash;
+	}();
+	return key;
+}
+
+inline uint64_t sourceKey(std::string_view vertexSource, std::string_view fragmentSource) {
+	uint64_t hash = util::fnv1a(vertexSource);
+	hash = util::fnv1a_value('\0', hash);
+	hash = util::fnv1a(fragmentSource, hash);
+	hash = util::fnv1a_value(VERSION, hash);
+	return util::fnv1a_value(driverKey(), hash);
+}
+
+inline fs::path cachePath(const fs::path& directory, uint64_t key) {
+	char name[32];
+	std::snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(key));
+	return directory / name;
+}
+
+// Loads the binary into program, which links it. Returns false if there is
+// no entry, or the driver rejects it; the program must then be built from
+// source.
+inline bool load(const fs::path& directory, uint64_t key, GLuint program) {
+	if (!supported())
+		return false;
+	MappedFile file(cachePath(directory, key));
+	if (!file || file.size() < sizeof(Header))
+		return false;
+	Header header;
+	std::memcpy(&header, file.data(), sizeof(Header));
+	if (header.magic != MAGIC || header.version != VERSION || header.key != key
+		|| header.size != file.size() - sizeof(Header))
+		return false;
+	glProgramBinary(program, header.format, file.data() + sizeof(Header), GLsizei(header.size));
+	GLint linked = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	return linked == GL_TRUE;
+}
+
+// Stores a linked program. Call glProgramParameteri with
+// GL_PROGRAM_BINARY_RETRIEVABLE_HINT before linking it.
+inline bool save(const fs::path& directory, uint64_t key, GLuint program) {
+	if (!supported())
+		return false;
+	GLint linked = GL_FALSE, length = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (linked != GL_TRUE || length <= 0)
+		return false;
+	std::vector<unsigned char> binary(sizeof(Header) + size_t(length));
+	GLenum format = 0;
+	GLsizei written = 0;
+	glGetProgramBinary(program, length, &written, &format, binary.data() + sizeof(Header));
+	Header header{ MAGIC, VERSION, key, uint32_t(format), uint32_t(written) };
+	std::memcpy(binary.data(), &header, sizeof(Header));
+	binary.resize(sizeof(Header) + size_t(written));
+
+	// Write to a temporary file first so a partial write never looks valid
+	std::error_code ec;
+	fs::create_directories(directory, ec);
+	fs::path path = cachePath(directory, key);
+	fs::path tmpPath = path;
+	tmpPath += ".tmp";
+	{
+		std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+		if (!out) {
+			std::cerr << "ERROR::PROGRAM_CACHE::Failed to write " << tmpPath << std::endl;
+			return false;
+		}
+	}
+	fs::rename(tmpPath, path, ec);
+	if (ec) {
+		std::cerr << "ERROR::PROGRAM_CACHE::Failed to write " << path << ": " << ec.message() << std::endl;
+		fs::remove(tmpPath, ec);
+		return false;
+	}
+	return true;
+}
+
+}
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "gl_state.h"
+#include "instance_buffer.h"
+#include "material.h"
+#include "mesh.h"
+#include "meshlet.h"
+#include "model.h"
+#include "shader.h"
+#include "shader_permutations.h"
+
+enum class RenderPass : uint8_t {
+	Opaque,
+	Blended,
+};
+
+// One mesh draw: what to draw, with which program and material, where
+struct DrawPacket
+{
+	const Mesh* mesh = nullptr;
+	const Shader* shader = nullptr;
+	// Applied through MaterialTracker; without one the mesh is drawn with
+	// whatever material uniforms the program has
+	const Material* material = nullptr;
+	glm::mat4 transform = glm::mat4(1.0f);
+	RenderPass pass = RenderPass::Opaque;
+	size_t lod = 0;
+	// At LOD 0, also cull the mesh's meshlets against the frame's view
+	bool cullMeshlets = false;
+	// If set, draws these in one call with an instancing shader; the
+	// transform then only places the packet for depth sorting. The data must
+	// stay valid until flush().
+	std::span<const InstanceData> instances{};
+};
+
+// Collects a frame's draws and submits them sorted by a 64-bit key, so that
+// draws sharing a program, material and vertex array run together and state
+// changes scale with the number of distinct states, not of objects.
+//
+// Opaque draws come first, grouped by program, then material, then vertex
+// array, and front to back within a group so early depth testing rejects
+// hidden fragments. Blended draws follow back to front, as blending needs.
+//   opaque:  pass:1 | program:12 | material:12 | vertex array:12 | depth:24
+//   blended: pass:1 | far to near depth:24 | program:12 | material:12 | vertex array:12
+// Programs, materials and vertex arrays are numbered in the order they are
+// first queued in a frame; past 4096 of a kind the numbers wrap, which only
+// costs some grouping.
+class RenderQueue
+{
+public:
+	// State changes made by the last flush()
+	struct Stats {
+		size_t draws = 0;
+		size_t programs = 0;
+		size_t materials = 0;
+		size_t vertexArrays = 0;
+	};
+
+	// Starts a frame seen from the given camera, dropping anything queued
+	void begin(const glm::mat4& projection, const glm::mat4& view, const glm::vec3& cameraPosition);
+
+	void submit(const DrawPacket& packet);
+	void submit(const Mesh& mesh, const Shader& shader, const glm::mat4& transform,
+		RenderPass pass = RenderPass::Opaque) {
+		submit(DrawPacket{ .mesh = &mesh, .shader = &shader, .material = mesh.material,
+			.transform = transform, .pass = pass });
+	}
+	// Queues every mesh instance of the model that is in view, at the LOD the
+	// selector picks, with the permutation for its material and the lights
+	void submit(const Model& model, ShaderPermutations& shaders, const ShaderFeatures& lights,
+		const LodSelector& selector, const glm::mat4& modelMatrix,
+		RenderPass pass = RenderPass::Opaque);
+
+	// Sorts and draws everything queued, and empties the queue
+	void flush();
+
+	size_t size() const { return packets.size(); }
+	const Stats& stats() const { return lastStats; }
+
+private:
+	struct Item {
+		uint64_t key;
+		uint32_t packet;
+	};
+
+	static constexpr int ID_BITS = 12;
+	static constexpr int DEPTH_BITS = 24;
+
+	uint64_t sortKey(const DrawPacket& packet);
+	static uint32_t number(std::unordered_map<uintptr_t, uint32_t>& ids, uintptr_t object);
+	// Meshes in a geometry buffer share its VAO, others have their own
+	static const void* vertexArrayOf(const Mesh& mesh) {
+		return mesh.geometry() ? static_cast<const void*>(mesh.geometry()) : &mesh;
+	}
+	static void radixSort(std::vector<Item>& items, std::vector<Item>& scratch);
+
+	glm::mat4 projection = glm::mat4(1.0f);
+	glm::mat4 view = glm::mat4(1.0f);
+	glm::vec3 cameraPosition = glm::vec3(0.0f);
+	std::vector<DrawPacket> packets;
+	std::vector<Item> items, scratch;
+	std::unordered_map<uintptr_t, uint32_t> programIds, materialIds, vertexArrayIds;
+	Stats lastStats;
+};
+
+inline void RenderQueue::begin(const glm::mat4& projection, const glm::mat4& view,
+	const glm::vec3& cameraPosition)
+{
+	this->projection = projection;
+	this->view = view;
+	this->cameraPosition = cameraPosition;
+	packets.clear();
+	items.clear();
+	programIds.clear();
+	materialIds.clear();
+	vertexArrayIds.clear();
+}
+
+inline void RenderQueue::submit(const DrawPacket& packet)
+{
+	items.push_back({ sortKey(packet), uint32_t(packets.size()) });
+	packets.push_back(packet);
+}
+
+inline void RenderQueue::submit(const Model& model, ShaderPermutations& shaders,
+	const ShaderFeatures& lights, const LodSelector& selector, const glm::mat4& modelMatrix,
+	RenderPass pass)
+{
+	auto submitOne = [&](const Mesh& mesh, const glm::mat4& transform) {
+		MeshletCuller culler(projection, view, transform, cameraPosition);
+		if (!culler.visible(mesh.center(), mesh.radius()))
+			return;
+		const Shader& shader = mesh.material
+			? mesh.material->selectShader(shaders, lights) : shaders.get(lights);
+		size_t lod = selector.select(mesh, transform);
+		submit(DrawPacket{ .mesh = &mesh, .shader = &shader, .material = mesh.material,
+			.transform = transform, .pass = pass, .lod = lod, .cullMeshlets = lod == 0 });
+	};
+	if (model.nodes.empty()) {
+		for (const Mesh& mesh : model.meshes)
+			submitOne(mesh, modelMatrix);
+	}
+	for (const Model::Node& node : model.nodes) {
+		glm::mat4 transform = modelMatrix * node.globalTransform;
+		for (unsigned int index : node.meshes)
+			submitOne(model.meshes[index], transform);
+	}
+}
+
+inline uint32_t RenderQueue::number(std::unordered_map<uintptr_t, uint32_t>& ids,
+	uintptr_t object)
+{
+	auto [it, inserted] = ids.try_emplace(object, uint32_t(ids.size()));
+	return it->second & ((1u << ID_BITS) - 1);
+}
+
+inline uint64_t RenderQueue::sortKey(const DrawPacket& packet)
+{
+	uint64_t program = number(programIds, packet.shader->id());
+	uint64_t material = number(materialIds, reinterpret_cast<uintptr_t>(packet.material));
+	uint64_t vao = number(vertexArrayIds, reinterpret_cast<uintptr_t>(vertexArrayOf(*packet.mesh)));
+
+	// Distance along the view direction. The bits of a non-negative float
+	// order like the float, so the top ones make a depth key.
+	glm::vec4 center = view * (packet.transform * glm::vec4(packet.mesh->center(), 1.0f));
+	float distance = glm::max(-center.z, 0.0f);
+	uint32_t bits;
+	std::memcpy(&bits, &distance, sizeof(bits));
+	uint64_t depth = bits >> (32 - DEPTH_BITS);
+
+	uint64_t state = program << (2 * ID_BITS) | material << ID_BITS | vao;
+	if (packet.pass == RenderPass::Opaque)
+		return state << DEPTH_BITS | depth;
+	uint64_t farToNear = ~depth & ((1ull << DEPTH_BITS) - 1);
+	return 1ull << 63 | farToNear << (3 * ID_BITS) | state;
+}
+
+// LSD radix sort on 8-bit digits; digits that are the same in every key,
+// such as those of unused key bits, are skipped
+inline void RenderQueue::radixSort(std::vector<Item>& items, std::vector<Item>& scratch)
+{
+	constexpr int DIGITS = 8;
+	std::array<std::array<uint32_t, 256>, DIGITS> counts{};
+	for (const Item& item : items) {
+		for (int d = 0; d < DIGITS; d++)
+			counts[d][(item.key >> (8 * d)) & 0xff]++;
+	}
+	scratch.resize(items.size());
+	for (int d = 0; d < DIGITS; d++) {
+		auto& count = counts[d];
+		if (count[(items[0].key >> (8 * d)) & 0xff] == items.size())
+			continue;
+		uint32_t offset = 0;
+		for (uint32_t& c : count) {
+			uint32_t n = c;
+			c = offset;
+			offset += n;
+		}
+		for (const Item& item : items)
+			scratch[count[(item.key >> (8 * d)) & 0xff]++] = item;
+		items.swap(scratch);
+	}
+}
+
+inline void RenderQueue::flush()
+{
+	lastStats = {};
+	if (items.empty())
+		return;
+	radixSort(items, scratch);
+
+	GLState& gl = GLState::shared();
+	const Shader* shader = nullptr;
+	GLuint program = 0;
+	const Material* material = nullptr;
+	const void* vertexArray = nullptr;
+	bool blending = false;
+	for (const Item& item : items) {
+		const DrawPacket& p = packets[item.packet];
+		if (p.pass == RenderPass::Blended && !blending) {
+			gl.enable(GL_BLEND);
+			gl.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			gl.depthMask(false);
+			blending = true;
+		}
+		shader = p.shader;
+		if (shader->id() != program) {
+			program = shader->id();
+			shader->use();
+			material = nullptr;
+			lastStats.programs++;
+		}
+		if (p.instances.empty())
+			shader->setMat4("model", p.transform);
+		if (p.material && p.material != material) {
+			material = p.material;
+			MaterialTracker::shared().apply(*shader, *material);
+			lastStats.materials++;
+		}
+		const void* vao = vertexArrayOf(*p.mesh);
+		if (vao != vertexArray) {
+			vertexArray = vao;
+			lastStats.vertexArrays++;
+		}
+		if (!p.instances.empty())
+			p.mesh->drawInstanced(*shader, p.instances, false, p.lod);
+		else if (p.cullMeshlets && p.lod == 0)
+			p.mesh->drawCulled(*shader, MeshletCuller(projection, view, p.transform, cameraPosition), false);
+		else
+			p.mesh->draw(*shader, false, p.lod);
+		lastStats.draws++;
+	}
+	if (blending) {
+		gl.disable(GL_BLEND);
+		gl.depthMask(true);
+	}
+	packets.clear();
+	items.clear();
+}
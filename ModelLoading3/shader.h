@@ -4,20 +4,96 @@
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 
+#include "gl_handle.h"
+#include "program_cache.h"
+#include "utils.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <unordered_map>
+#include <vector>
+
+
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+// Uniform blocks shared by all programs, bound to fixed binding points when a
+// program is linked. See UniformBuffer.
+namespace uniform_blocks {
+constexpr GLuint FRAME = 0;
+constexpr GLuint LIGHTS = 1;
+
+struct Block {
+	const char* name;
+	GLuint binding;
+};
+constexpr Block ALL[] = { { "Frame", FRAME }, { "Lights", LIGHTS } };
+}
+
+// A uniform name, identified by its hash. String literals are hashed at
+// compile time; struct fields and array elements extend the hash without
+// building strings, so Uniform("lights")[2].field("color") is the same as
+// "lights[2].color".
+class Uniform
+{
+public:
+	template <size_t N>
+	consteval Uniform(const char (&name)[N]) : hash(util::fnv1a(std::string_view(name, N - 1))) {}
+	explicit constexpr Uniform(std::string_view name) : hash(util::fnv1a(name)) {}
+	Uniform(const std::string& name) : hash(util::fnv1a(name)) {}
+
+	constexpr Uniform field(std::string_view name) const {
+		return Uniform(util::fnv1a(name, util::fnv1a(std::string_view("."), hash)), 0);
+	}
+	constexpr Uniform operator[](size_t index) const {
+		char digits[20];
+		size_t n = 0;
+		do {
+			digits[n++] = char('0' + index % 10);
+			index /= 10;
+		} while (index);
+		uint64_t h = util::fnv1a(std::string_view("["), hash);
+		while (n)
+			h = util::fnv1a(std::string_view(&digits[--n], 1), h);
+		return Uniform(util::fnv1a(std::string_view("]"), h), 0);
+	}
+
+	uint64_t hash;
+
+private:
+	constexpr Uniform(uint64_t hash, int) : hash(hash) {}
+};
 
 
 class Shader
 {
 public:
-	// the program ID
-	unsigned int id;
+	// A linked program and its uniform locations. Shaders built from the same
+	// sources share one, and it is deleted with the last of them.
+	struct Program {
+		ProgramHandle handle;
+		std::unordered_map<uint64_t, GLint> locations;
+		// Set until finish(); a program compiled from source keeps its stage
+		// shaders until then, for their logs
+		bool pending = true;
+		ShaderHandle vertex, fragment;
+		uint64_t cacheKey = 0;
+		std::filesystem::path cacheDirectory;
+	};
 
-	// constructor reads and builds the shader
-	Shader(const char* vertexPath, const char* fragmentPath) {
+	// constructor reads and builds the shader. With wait set to false it only
+	// starts compiling and linking: the program is finished by ready(), or at
+	// its first use. See ShaderBatch. Defines are inserted into both sources
+	// after their #version line, see ShaderPermutations.
+	Shader(const char* vertexPath, const char* fragmentPath, bool wait = true,
+		std::string_view defines = {}) {
 		// 1. retrieve the vertex/fragment source code from filePath
 		std::string vertexCode;
 		std::string fragmentCode;
@@ -46,80 +122,224 @@ public:
 		{
 			std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ\n" << e.what() << std::endl;
 		}
-		const char* vShaderCode = vertexCode.c_str();
-		const char* fShaderCode = fragmentCode.c_str();
+		if (!defines.empty()) {
+			insertDefines(vertexCode, defines);
+			insertDefines(fragmentCode, defines);
+		}
 
-		// 2. compile shaders
-		unsigned int vertex, fragment;
-		// vertex Shader
-		vertex = glCreateShader(GL_VERTEX_SHADER);
-		glShaderSource(vertex, 1, &vShaderCode, NULL);
-		glCompileShader(vertex);
-		checkCompileErrors(vertex, "VERTEX");
-		// fragment Shader
-		fragment = glCreateShader(GL_FRAGMENT_SHADER);
-		glShaderSource(fragment, 1, &fShaderCode, NULL);
-		glCompileShader(fragment);
-		checkCompileErrors(fragment, "FRAGMENT");
-		// shader Program
-		id = glCreateProgram();
-		glAttachShader(id, vertex);
-		glAttachShader(id, fragment);
-		glLinkProgram(id);
-		checkCompileErrors(id, "PROGRAM");
-		// delete the shaders as they're linked into our program now and no longer necessary
-		glDeleteShader(vertex);
-		glDeleteShader(fragment);
+		// 2. reuse a program with the same sources, or the binary cached on
+		// disk by an earlier run, and only compile if neither is available
+		uint64_t key = program_cache::sourceKey(vertexCode, fragmentCode);
+		std::weak_ptr<Program>& shared = programs()[key];
+		program = shared.lock();
+		if (program) {
+			if (wait)
+				finish();
+			return;
+		}
+		program = std::make_shared<Program>();
+		program->handle.reset(glCreateProgram());
+		program->cacheKey = key;
+		program->cacheDirectory = std::filesystem::path(vertexPath).parent_path() / "cache";
+		if (!program_cache::load(program->cacheDirectory, key, id()))
+			compile(vertexCode.c_str(), fragmentCode.c_str());
+		shared = program;
+		if (wait)
+			finish();
+	}
+
+	// Whether the program has finished linking, without blocking when the
+	// driver compiles in parallel (GL_KHR_parallel_shader_compile). Without
+	// it, this waits for the program.
+	bool ready() const {
+		if (program->pending && parallelCompile()) {
+			GLint done = GL_FALSE;
+			glGetProgramiv(id(), GL_COMPLETION_STATUS_KHR, &done);
+			if (!done)
+				return false;
+		}
+		finish();
+		return true;
+	}
+
+	// Waits for the program, reports errors and resolves its uniforms
+	void finish() const {
+		if (!program->pending)
+			return;
+		program->pending = false;
+		if (program->vertex) {
+			checkCompileErrors(program->vertex.get(), "VERTEX");
+			checkCompileErrors(program->fragment.get(), "FRAGMENT");
+			checkCompileErrors(id(), "PROGRAM");
+			program->vertex.reset();
+			program->fragment.reset();
+			program_cache::save(program->cacheDirectory, program->cacheKey, id());
+		}
+		reflectUniforms();
+		bindUniformBlocks();
+	}
+
+	static bool parallelCompile() {
+		static const bool supported = [] {
+			GLint count = 0;
+			glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+			for (GLint i = 0; i < count; i++) {
+				auto name = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, GLuint(i)));
+				if (name && (std::string_view(name) == "GL_KHR_parallel_shader_compile"
+					|| std::string_view(name) == "GL_ARB_parallel_shader_compile"))
+					return true;
+			}
+			return false;
+		}();
+		return supported;
+	}
+
+	// the program ID
+	unsigned int id() const {
+		return program ? program->handle.get() : 0;
+	}
+
+	// -1 for names that aren't active uniforms, which glUniform* ignores
+	GLint location(Uniform name) const {
+		finish();
+		auto it = program->locations.find(name.hash);
+		return it != program->locations.end() ? it->second : -1;
 	}
 
 	// use/activate the shader
 	void use() const {
-		glUseProgram(id);
+		finish();
+		GLState::shared().useProgram(id());
 	}
 
 	// utility uniform functions
-	void setBool(const std::string &name, bool value) const {
-		glUniform1i(glGetUniformLocation(id, name.c_str()), value);
+	void setBool(Uniform name, bool value) const {
+		glUniform1i(location(name), value);
 	}
-	void setInt(const std::string &name, int value) const {
-		glUniform1i(glGetUniformLocation(id, name.c_str()), value);
+	void setInt(Uniform name, int value) const {
+		glUniform1i(location(name), value);
 	}
-	void setUInt(const std::string &name, unsigned int value) const {
-		glUniform1ui(glGetUniformLocation(id, name.c_str()), value);
+	void setUInt(Uniform name, unsigned int value) const {
+		glUniform1ui(location(name), value);
 	}
-	void setFloat(const std::string &name, float value) const {
-		glUniform1f(glGetUniformLocation(id, name.c_str()), value);
+	void setFloat(Uniform name, float value) const {
+		glUniform1f(location(name), value);
 	}
-	void setVec2(const std::string &name, const glm::vec2 &value) const {
-		glUniform2fv(glGetUniformLocation(id, name.c_str()), 1, &value[0]);
+	void setVec2(Uniform name, const glm::vec2 &value) const {
+		glUniform2fv(location(name), 1, &value[0]);
 	}
-	void setVec2(const std::string &name, float x, float y) const {
-		glUniform2f(glGetUniformLocation(id, name.c_str()), x, y);
+	void setVec2(Uniform name, float x, float y) const {
+		glUniform2f(location(name), x, y);
 	}
-	void setVec3(const std::string &name, const glm::vec3 &value) const {
-		glUniform3fv(glGetUniformLocation(id, name.c_str()), 1, &value[0]);
+	void setVec3(Uniform name, const glm::vec3 &value) const {
+		glUniform3fv(location(name), 1, &value[0]);
 	}
-	void setVec3(const std::string &name, float x, float y, float z) const {
-		glUniform3f(glGetUniformLocation(id, name.c_str()), x, y, z);
+	void setVec3(Uniform name, float x, float y, float z) const {
+		glUniform3f(location(name), x, y, z);
 	}
-	void setVec4(const std::string &name, const glm::vec4 &value) const {
-		glUniform4fv(glGetUniformLocation(id, name.c_str()), 1, &value[0]);
+	void setVec4(Uniform name, const glm::vec4 &value) const {
+		glUniform4fv(location(name), 1, &value[0]);
 	}
-	void setVec4(const std::string &name, float x, float y, float z, float w) const {
-		glUniform4f(glGetUniformLocation(id, name.c_str()), x, y, z, w);
+	void setVec4(Uniform name, float x, float y, float z, float w) const {
+		glUniform4f(location(name), x, y, z, w);
 	}
-	void setMat2(const std::string &name, const glm::mat2 &mat) const {
-		glUniformMatrix2fv(glGetUniformLocation(id, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+	void setMat2(Uniform name, const glm::mat2 &mat) const {
+		glUniformMatrix2fv(location(name), 1, GL_FALSE, &mat[0][0]);
 	}
-	void setMat3(const std::string &name, const glm::mat3 &mat) const {
-		glUniformMatrix3fv(glGetUniformLocation(id, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+	void setMat3(Uniform name, const glm::mat3 &mat) const {
+		glUniformMatrix3fv(location(name), 1, GL_FALSE, &mat[0][0]);
 	}
-	void setMat4(const std::string &name, const glm::mat4 &mat) const {
-		glUniformMatrix4fv(glGetUniformLocation(id, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+	void setMat4(Uniform name, const glm::mat4 &mat) const {
+		glUniformMatrix4fv(location(name), 1, GL_FALSE, &mat[0][0]);
 	}
 
 private:
-	void checkCompileErrors(unsigned int shader, const std::string &type) {
+	static void insertDefines(std::string& source, std::string_view defines) {
+		size_t at = 0;
+		size_t version = source.find("#version");
+		if (version != std::string::npos) {
+			at = source.find('\n', version);
+			if (at == std::string::npos) {
+				source += '\n';
+				at = source.size();
+			}
+			else {
+				at++;
+			}
+		}
+		source.insert(at, defines);
+	}
+
+	// starts compiling and linking the program from source. Nothing here
+	// queries the results, so the driver can work on it in the background;
+	// finish() checks them. The shader objects are deleted after that, as
+	// they're linked into our program and no longer necessary.
+	void compile(const char* vShaderCode, const char* fShaderCode) {
+		// vertex Shader
+		program->vertex.reset(glCreateShader(GL_VERTEX_SHADER));
+		glShaderSource(program->vertex.get(), 1, &vShaderCode, NULL);
+		glCompileShader(program->vertex.get());
+		// fragment Shader
+		program->fragment.reset(glCreateShader(GL_FRAGMENT_SHADER));
+		glShaderSource(program->fragment.get(), 1, &fShaderCode, NULL);
+		glCompileShader(program->fragment.get());
+		// shader Program
+		if (program_cache::supported())
+			glProgramParameteri(id(), GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		glAttachShader(id(), program->vertex.get());
+		glAttachShader(id(), program->fragment.get());
+		glLinkProgram(id());
+	}
+
+	// Programs by source key, for sharing them between shaders
+	static std::unordered_map<uint64_t, std::weak_ptr<Program>>& programs() {
+		static std::unordered_map<uint64_t, std::weak_ptr<Program>> map;
+		return map;
+	}
+
+	// Resolves every active uniform location once, keyed by name hash
+	void reflectUniforms() const {
+		GLint count = 0, maxLength = 0;
+		glGetProgramiv(id(), GL_ACTIVE_UNIFORMS, &count);
+		glGetProgramiv(id(), GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+		std::string name(size_t(maxLength) + 16, '\0');
+		for (GLint i = 0; i < count; i++) {
+			GLsizei length = 0;
+			GLint size = 0;
+			GLenum type;
+			glGetActiveUniform(id(), GLuint(i), maxLength, &length, &size, &type, name.data());
+			std::string_view active(name.data(), size_t(length));
+			// arrays of plain types are listed once, as "name[0]"
+			if (active.ends_with("[0]")) {
+				std::string_view base = active.substr(0, active.size() - 3);
+				std::string element(base);
+				for (GLint e = 0; e < size; e++) {
+					element.resize(base.size());
+					element += "[" + std::to_string(e) + "]";
+					GLint location = glGetUniformLocation(id(), element.c_str());
+					program->locations[util::fnv1a(element)] = location;
+					if (e == 0)
+						program->locations[util::fnv1a(base)] = location;
+				}
+			}
+			else {
+				// members of uniform blocks have no location
+				GLint location = glGetUniformLocation(id(), name.c_str());
+				if (location >= 0)
+					program->locations[util::fnv1a(active)] = location;
+			}
+		}
+	}
+
+	void bindUniformBlocks() const {
+		for (const uniform_blocks::Block& block : uniform_blocks::ALL) {
+			GLuint index = glGetUniformBlockIndex(id(), block.name);
+			if (index != GL_INVALID_INDEX)
+				glUniformBlockBinding(id(), index, block.binding);
+		}
+	}
+
+	void checkCompileErrors(unsigned int shader, const std::string &type) const {
 		int success;
 		char infoLog[1024];
 		if (type != "PROGRAM") {
@@ -137,6 +357,37 @@ private:
 			}
 		}
 	}
+
+	std::shared_ptr<Program> program;
+};
+
+// Compiles shaders side by side: everything is submitted up front, and
+// pending() polls them without blocking, so that other loading can go on
+// meanwhile.
+class ShaderBatch
+{
+public:
+	Shader add(const char* vertexPath, const char* fragmentPath) {
+		return shaders.emplace_back(vertexPath, fragmentPath, false);
+	}
+	// Waits for a shader that is already compiling, such as a permutation
+	void add(const Shader& shader) {
+		shaders.push_back(shader);
+	}
+	// the number of shaders that are still compiling
+	size_t pending() {
+		std::erase_if(shaders, [](const Shader& shader) { return shader.ready(); });
+		return shaders.size();
+	}
+	bool ready() { return pending() == 0; }
+	void finish() {
+		for (const Shader& shader : shaders)
+			shader.finish();
+		shaders.clear();
+	}
+
+private:
+	std::vector<Shader> shaders;
 };
 
 #endif
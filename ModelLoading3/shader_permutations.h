@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "lights.h"
+#include "shader.h"
+#include "utils.h"
+
+// What a shader permutation is specialized for: the material textures that
+// are bound, the number of each kind of light and whether it draws
+// instances. The shaders see them as PERMUTATION, HAS_<NAME>_TEXTURE,
+// NUM_<KIND>_LIGHTS and INSTANCED defines, so unbound textures are never
+// sampled and the light loops have constant bounds.
+struct ShaderFeatures
+{
+	enum TextureBits : uint32_t {
+		DIFFUSE_TEXTURE = 1 << 0,
+		SPECULAR_TEXTURE = 1 << 1,
+		EMISSIVE_TEXTURE = 1 << 2,
+		AO_TEXTURE = 1 << 3,
+	};
+
+	uint32_t textures = 0;
+	int numDirLights = 0;
+	int numPointLights = 0;
+	int numSpotLights = 0;
+	// Reads the model matrix from InstanceData attributes, see Mesh::drawInstanced
+	bool instanced = false;
+
+	static ShaderFeatures forLights(const LightsBlock& lights) {
+		return { 0, lights.numDirLights, lights.numPointLights, lights.numSpotLights };
+	}
+	bool operator==(const ShaderFeatures&) const = default;
+
+	uint64_t key() const;
+	std::string defines() const;
+};
+
+// Variants of one vertex and fragment shader pair, by ShaderFeatures. Each
+// variant is compiled the first time it is asked for, and kept.
+class ShaderPermutations
+{
+public:
+	ShaderPermutations(std::string vertexPath, std::string fragmentPath)
+		: vertexPath(std::move(vertexPath)), fragmentPath(std::move(fragmentPath)) {}
+
+	// Doesn't wait for a new variant to compile; using it does
+	const Shader& get(const ShaderFeatures& features);
+	size_t size() const { return variants.size(); }
+
+private:
+	std::string vertexPath, fragmentPath;
+	std::unordered_map<uint64_t, Shader> variants;
+};
+
+inline uint64_t ShaderFeatures::key() const
+{
+	uint64_t hash = util::fnv1a_value(textures, util::FNV_OFFSET_BASIS);
+	hash = util::fnv1a_value(numDirLights, hash);
+	hash = util::fnv1a_value(numPointLights, hash);
+	hash = util::fnv1a_value(numSpotLights, hash);
+	return util::fnv1a_value(instanced, hash);
+}
+
+inline std::string ShaderFeatures::defines() const
+{
+	std::string s = "#define PERMUTATION\n";
+	if (textures & DIFFUSE_TEXTURE)
+		s += "#define HAS_DIFFUSE_TEXTURE\n";
+	if (textures & SPECULAR_TEXTURE)
+		s += "#define HAS_SPECULAR_TEXTURE\n";
+	if (textures & EMISSIVE_TEXTURE)
+		s += "#define HAS_EMISSIVE_TEXTURE\n";
+	if (textures & AO_TEXTURE)
+		s += "#define HAS_AO_TEXTURE\n";
+	s += "#define NUM_DIR_LIGHTS " + std::to_string(numDirLights) + "\n";
+	s += "#define NUM_POINT_LIGHTS " + std::to_string(numPointLights) + "\n";
+	s += "#define NUM_SPOT_LIGHTS " + std::to_string(numSpotLights) + "\n";
+	if (instanced)
+		s += "#define INSTANCED\n";
+	return s;
+}
+
+inline const Shader& ShaderPermutations::get(const ShaderFeatures& features)
+{
+	uint64_t key = features.key();
+	auto it = variants.find(key);
+	if (it == variants.end()) {
+		it = variants.try_emplace(key, vertexPath.c_str(), fragmentPath.c_str(), false,
+			features.defines()).first;
+	}
+	return it->second;
+}
@@ -7,15 +7,49 @@ out vec3 FragPos;
 out vec3 Normal;
 out vec2 TexCoords;
 
+#ifdef INSTANCED
+// Per-instance attributes, see InstanceData
+layout (location = 3) in mat4 aModel;
+layout (location = 7) in mat3 aNormalMatrix;
+layout (location = 10) in vec4 aTint;
+out vec4 Tint;
+#else
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+#endif
+
+// Shared by all programs, see FrameBlock
+layout (std140) uniform Frame {
+	mat4 projection;
+	mat4 view;
+	vec3 viewPos;
+};
+
+// Vertex format decoding, see VertexFormat
+uniform vec3 positionOffset;
+uniform vec3 positionScale;
+uniform bool octNormals;
+
+vec3 octDecode(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0)
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	return normalize(n);
+}
 
 void main()
 {
-	vec4 position = model * vec4(aPosition, 1.0);
+#ifdef INSTANCED
+	mat4 model = aModel;
+	mat3 normalMatrix = aNormalMatrix;
+	Tint = aTint;
+#else
+	mat3 normalMatrix = transpose(inverse(mat3(model)));
+#endif
+	vec3 normal = octNormals ? octDecode(aNormal.xy) : aNormal;
+	vec4 position = model * vec4(positionOffset + positionScale * aPosition, 1.0);
 	gl_Position = projection * (view * position);
 	FragPos = vec3(position);
-	Normal = transpose(inverse(mat3(model))) * aNormal;
+	Normal = normalMatrix * normal;
 	TexCoords = aTexCoords;
 }
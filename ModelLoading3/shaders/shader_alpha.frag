@@ -4,6 +4,9 @@ out vec4 FragColor;
 in vec3 FragPos;
 in vec3 Normal;
 in vec2 TexCoords;
+#ifdef INSTANCED
+in vec4 Tint;
+#endif
 
 struct Texture {
 	sampler2D texture;
@@ -63,18 +66,57 @@ struct SpotLight {
 
 #define MAX_LIGHTS 10
 
-uniform vec3 viewPos;
-uniform Material material;
+// Shared by all programs, see FrameBlock and LightsBlock
+layout (std140) uniform Frame {
+	mat4 projection;
+	mat4 view;
+	vec3 viewPos;
+};
 
-uniform int numDirLights, numPointLights, numSpotLights;
-uniform DirLight dirLights[MAX_LIGHTS];
-uniform PointLight pointLights[MAX_LIGHTS];
-uniform SpotLight spotLights[MAX_LIGHTS];
+layout (std140) uniform Lights {
+	int numDirLights, numPointLights, numSpotLights;
+	DirLight dirLights[MAX_LIGHTS];
+	PointLight pointLights[MAX_LIGHTS];
+	SpotLight spotLights[MAX_LIGHTS];
+};
+
+uniform Material material;
 
+// Permutations have constant light counts
+#ifndef PERMUTATION
+#define NUM_DIR_LIGHTS numDirLights
+#define NUM_POINT_LIGHTS numPointLights
+#define NUM_SPOT_LIGHTS numSpotLights
+#endif
+
+// Permutations know which textures are bound, and don't sample the others
+#ifdef PERMUTATION
+#ifdef HAS_DIFFUSE_TEXTURE
+vec4 diffTex = texture(material.diffuse_texture.texture, TexCoords);
+#else
+vec4 diffTex = vec4(1.0);
+#endif
+#ifdef HAS_SPECULAR_TEXTURE
+vec4 specTex = texture(material.specular_texture.texture, TexCoords);
+#else
+vec4 specTex = vec4(1.0);
+#endif
+#ifdef HAS_EMISSIVE_TEXTURE
+vec4 emissTex = texture(material.emissive_texture.texture, TexCoords);
+#else
+vec4 emissTex = vec4(1.0);
+#endif
+#ifdef HAS_AO_TEXTURE
+vec4 aoTex = texture(material.ao_texture.texture, TexCoords);
+#else
+vec4 aoTex = vec4(1.0);
+#endif
+#else
 vec4 diffTex = GetTexture(material.diffuse_texture, TexCoords);
 vec4 specTex = GetTexture(material.specular_texture, TexCoords);
 vec4 emissTex = GetTexture(material.emissive_texture, TexCoords);
 vec4 aoTex = GetTexture(material.ao_texture, TexCoords);
+#endif
 
 vec3 CalcDirLight(DirLight light, vec3 normal, vec3 viewDir)
 {
@@ -137,6 +179,10 @@ vec3 CalcSpotLight(SpotLight light, vec3 normal, vec3 fragPos, vec3 viewDir)
 
 void main()
 {
+#ifdef INSTANCED
+	diffTex *= Tint;
+	emissTex *= Tint;
+#endif
 	if (diffTex.a < 0.5)
 		discard;
 
@@ -145,11 +191,11 @@ void main()
 
 	vec3 color = vec3(0);
 
-	for (int i = 0; i < numDirLights; i++)
+	for (int i = 0; i < NUM_DIR_LIGHTS; i++)
 		color += CalcDirLight(dirLights[i], norm, viewDir);
-	for (int i = 0; i < numPointLights; i++)
+	for (int i = 0; i < NUM_POINT_LIGHTS; i++)
 		color += CalcPointLight(pointLights[i], norm, FragPos, viewDir);
-	for (int i = 0; i < numSpotLights; i++)
+	for (int i = 0; i < NUM_SPOT_LIGHTS; i++)
 		color += CalcSpotLight(spotLights[i], norm, FragPos, viewDir);
 
 	color *= aoTex.rgb;
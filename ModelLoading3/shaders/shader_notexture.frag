@@ -48,13 +48,28 @@ struct SpotLight {
 
 #define MAX_LIGHTS 10
 
-uniform vec3 viewPos;
+// Shared by all programs, see FrameBlock and LightsBlock
+layout (std140) uniform Frame {
+	mat4 projection;
+	mat4 view;
+	vec3 viewPos;
+};
+
+layout (std140) uniform Lights {
+	int numDirLights, numPointLights, numSpotLights;
+	DirLight dirLights[MAX_LIGHTS];
+	PointLight pointLights[MAX_LIGHTS];
+	SpotLight spotLights[MAX_LIGHTS];
+};
+
 uniform Material material;
 
-uniform int numDirLights, numPointLights, numSpotLights;
-uniform DirLight dirLights[MAX_LIGHTS];
-uniform PointLight pointLights[MAX_LIGHTS];
-uniform SpotLight spotLights[MAX_LIGHTS];
+// Permutations have constant light counts
+#ifndef PERMUTATION
+#define NUM_DIR_LIGHTS numDirLights
+#define NUM_POINT_LIGHTS numPointLights
+#define NUM_SPOT_LIGHTS numSpotLights
+#endif
 
 vec3 CalcDirLight(DirLight light, vec3 normal, vec3 viewDir)
 {
@@ -118,11 +133,11 @@ void main()
 	vec3 viewDir = normalize(viewPos - FragPos);
 	vec3 color;
 
-	for (int i = 0; i < numDirLights; i++)
+	for (int i = 0; i < NUM_DIR_LIGHTS; i++)
 		color += CalcDirLight(dirLights[i], norm, viewDir);
-	for (int i = 0; i < numPointLights; i++)
+	for (int i = 0; i < NUM_POINT_LIGHTS; i++)
 		color += CalcPointLight(pointLights[i], norm, FragPos, viewDir);
-	for (int i = 0; i < numSpotLights; i++)
+	for (int i = 0; i < NUM_SPOT_LIGHTS; i++)
 		color += CalcSpotLight(spotLights[i], norm, FragPos, viewDir);
 
     FragColor = vec4(color, 1.0);
@@ -2,47 +2,169 @@
 
 #include <iostream>
 #include <filesystem>
+#include <map>
+#include <memory>
+#include <system_error>
+#include <utility>
+#include <vector>
 
 #define STBI_WINDOWS_UTF8
 #include <stb_image.h>
 #include <glad/glad.h>
 
+#include "gl_handle.h"
 #include "shader.h"
 #include "u8tils.h"
 
+// Decoded image pixels, loaded without touching the GL context so that
+// decoding can run on worker threads
+class Image
+{
+public:
+	Image() {}
+	static Image load(const std::filesystem::path& path, bool flip = true);
+	explicit operator bool() const { return data != nullptr; }
+
+	int width = 0, height = 0, channels = 0;
+	std::unique_ptr<unsigned char, void(*)(void*)> data{ nullptr, stbi_image_free };
+	std::filesystem::path filename;
+};
+
+// Shared, refcounted handle to a GL texture. Copies refer to the same GL
+// object, which is deleted when the last handle goes away.
 class Texture
 {
 public:
 	Texture() {}
+	// Loads through the shared TextureCache
 	Texture(const std::filesystem::path& path, bool flip = true);
-	explicit operator bool() const { return id != 0; }
-	bool empty() const { return id == 0; }
-	void clear() { id = 0; filename.clear(); }
-	void apply(const Shader& shader, const std::string& name, unsigned int unit) const;
+	// Creates a new texture that isn't registered in the cache
+	explicit Texture(const Image& image);
+	explicit operator bool() const { return id() != 0; }
+	bool empty() const { return id() == 0; }
+	void clear() { data.reset(); }
+	unsigned int id() const { return data ? data->id.get() : 0; }
+	const std::filesystem::path& filename() const;
+	long useCount() const { return data.use_count(); }
+	// Sets the sampler and bound flag of a shader Texture struct
+	void apply(const Shader& shader, Uniform name, unsigned int unit) const;
 	friend std::ostream& operator<<(std::ostream& os, const Texture& texture);
 
-	unsigned int id = 0;
-	std::filesystem::path filename;
+private:
+	struct Data {
+		TextureHandle id;
+		std::filesystem::path filename;
+	};
+
+	// Handle to a texture that is uploaded later with upload()
+	static Texture placeholder(const std::filesystem::path& filename);
+	bool upload(const Image& image);
+
+	std::shared_ptr<Data> data;
+
+	friend class TextureCache;
+	friend class TextureLoader;
 };
 
-inline Texture::Texture(const std::filesystem::path& path, bool flip) : filename(path)
+// Deduplicates textures by canonical path and load options. The cache only
+// holds weak references, so it never keeps a texture alive by itself.
+// Not thread-safe; use from the GL context thread.
+class TextureCache
 {
-	// load image, create texture and generate mipmaps
-	int width, height, channels;
-	stbi_set_flip_vertically_on_load(flip);
-	unsigned char* data = stbi_load(u8::path_to_char(path), &width, &height, &channels, 0);
-	if (!data) {
+public:
+	struct Stats {
+		size_t hits = 0;
+		size_t misses = 0;
+		size_t live = 0;
+	};
+
+	// Returns the cached texture or loads it synchronously
+	Texture get(const std::filesystem::path& path, bool flip = true);
+	// Returns the cached texture, or an empty one on a miss
+	Texture find(const std::filesystem::path& path, bool flip = true);
+	void insert(const std::filesystem::path& path, bool flip, const Texture& texture);
+	void erase(const std::filesystem::path& path, bool flip);
+	Stats stats();
+	void resetStats() { hits = misses = 0; }
+
+	static TextureCache& shared();
+
+private:
+	using Key = std::pair<std::filesystem::path, bool>;
+	static Key makeKey(const std::filesystem::path& path, bool flip);
+	void collect();
+
+	std::map<Key, std::weak_ptr<Texture::Data>> entries;
+	size_t hits = 0;
+	size_t misses = 0;
+};
+
+inline Image Image::load(const std::filesystem::path& path, bool flip)
+{
+	// stbi_set_flip_vertically_on_load is global state and can't be used from
+	// several threads, so the image is flipped here instead
+	Image image;
+	image.filename = path;
+	image.data.reset(stbi_load(u8::path_to_char(path),
+		&image.width, &image.height, &image.channels, 0));
+	if (!image.data) {
 		std::cerr << "Failed to load texture: " << path << ": " << stbi_failure_reason() << std::endl;
-		clear();
-		return;
+		return image;
+	}
+	if (flip) {
+		size_t stride = size_t(image.width) * image.channels;
+		std::vector<unsigned char> row(stride);
+		unsigned char* pixels = image.data.get();
+		for (int y = 0; y < image.height / 2; y++) {
+			unsigned char* top = pixels + y * stride;
+			unsigned char* bottom = pixels + (image.height - 1 - y) * stride;
+			std::copy(top, top + stride, row.data());
+			std::copy(bottom, bottom + stride, top);
+			std::copy(row.data(), row.data() + stride, bottom);
+		}
 	}
+	return image;
+}
+
+inline Texture::Texture(const std::filesystem::path& path, bool flip)
+	: Texture(TextureCache::shared().get(path, flip))
+{}
+
+inline Texture::Texture(const Image& image)
+{
+	if (!image)
+		return;
+	data = std::make_shared<Data>();
+	data->filename = image.filename;
+	upload(image);
+}
+
+inline const std::filesystem::path& Texture::filename() const
+{
+	static const std::filesystem::path none;
+	return data ? data->filename : none;
+}
+
+inline Texture Texture::placeholder(const std::filesystem::path& filename)
+{
+	Texture texture;
+	texture.data = std::make_shared<Data>();
+	texture.data->filename = filename;
+	return texture;
+}
+
+inline bool Texture::upload(const Image& image)
+{
+	// create texture and generate mipmaps
+	if (!image || !data)
+		return false;
+	int width = image.width, height = image.height, channels = image.channels;
 	GLenum formats[] = { 0, GL_RED, GL_RG, GL_RGB, GL_RGBA };
 	GLenum format = formats[channels];
-	glGenTextures(1, &id);
-	glBindTexture(GL_TEXTURE_2D, id);
+	data->id = createTexture();
+	GLState::shared().bindTexture(0, data->id.get());
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-	glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-	stbi_image_free(data);
+	glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, image.data.get());
 
 	glGenerateMipmap(GL_TEXTURE_2D);
 	// set the texture wrapping parameters
@@ -60,19 +182,86 @@ inline Texture::Texture(const std::filesystem::path& path, bool flip) : filename
 		GLint swizzleMask[] = { GL_RED, GL_RED, GL_RED, GL_GREEN };
 		glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzleMask);
 	}
+	return true;
 }
 
-inline void Texture::apply(const Shader& shader, const std::string& name,
+inline void Texture::apply(const Shader& shader, Uniform name,
 		unsigned int unit) const {
-	glActiveTexture(GL_TEXTURE0 + unit);
-	glBindTexture(GL_TEXTURE_2D, id);
-	shader.setInt(name + ".texture", unit);
-	shader.setBool(name + ".bound", !empty());
+	GLState::shared().bindTexture(unit, id());
+	shader.setInt(name.field("texture"), unit);
+	shader.setBool(name.field("bound"), !empty());
 }
 
 inline std::ostream& operator<<(std::ostream& os, const Texture& texture)
 {
-	os << "Texture { " << texture.id;
-	if (texture) os << ": " << texture.filename;
+	os << "Texture { " << texture.id();
+	if (texture) os << ": " << texture.filename();
 	return os << " }";
 }
+
+inline Texture TextureCache::get(const std::filesystem::path& path, bool flip)
+{
+	Texture texture = find(path, flip);
+	if (texture.data)
+		return texture;
+	texture = Texture(Image::load(path, flip));
+	if (texture)
+		insert(path, flip, texture);
+	return texture;
+}
+
+inline Texture TextureCache::find(const std::filesystem::path& path, bool flip)
+{
+	Texture texture;
+	auto it = entries.find(makeKey(path, flip));
+	if (it != entries.end())
+		texture.data = it->second.lock();
+	if (texture.data)
+		hits++;
+	else
+		misses++;
+	return texture;
+}
+
+inline void TextureCache::insert(const std::filesystem::path& path, bool flip,
+	const Texture& texture)
+{
+	collect();
+	entries[makeKey(path, flip)] = texture.data;
+}
+
+inline void TextureCache::erase(const std::filesystem::path& path, bool flip)
+{
+	entries.erase(makeKey(path, flip));
+}
+
+inline TextureCache::Stats TextureCache::stats()
+{
+	collect();
+	return { hits, misses, entries.size() };
+}
+
+inline TextureCache& TextureCache::shared()
+{
+	static TextureCache cache;
+	return cache;
+}
+
+inline TextureCache::Key TextureCache::makeKey(const std::filesystem::path& path, bool flip)
+{
+	std::error_code ec;
+	std::filesystem::path canonical = std::filesystem::weakly_canonical(path, ec);
+	return { ec ? path.lexically_normal() : canonical, flip };
+}
+
+// Drop entries whose textures have been freed
+inline void TextureCache::collect()
+{
+	std::erase_if(entries, [](const auto& entry) { return entry.second.expired(); });
+}
+
+inline std::ostream& operator<<(std::ostream& os, const TextureCache::Stats& stats)
+{
+	return os << "TextureCache { hits: " << stats.hits << ", misses: " << stats.misses
+		<< ", live: " << stats.live << " }";
+}
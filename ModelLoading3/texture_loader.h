@@ -0,0 +1,78 @@
+#pragma once
+
+#include <filesystem>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <vector>
+
+#include "texture.h"
+#include "thread_pool.h"
+
+// Decodes a batch of images on a thread pool. Only the GL upload in finish()
+// runs on the calling thread, which must own the GL context. Requests are
+// resolved through the TextureCache, so a file is decoded at most once.
+class TextureLoader
+{
+public:
+	explicit TextureLoader(ThreadPool& pool = ThreadPool::shared(),
+		TextureCache& cache = TextureCache::shared())
+		: pool(pool), cache(cache) {}
+	// The returned texture stays empty until finish() uploads it
+	Texture request(const std::filesystem::path& path, bool flip = true);
+	// Waits for all decodes and uploads them
+	void finish();
+	// Uploads up to maxUploads textures that are already decoded, without
+	// waiting; returns how many were uploaded
+	size_t uploadReady(size_t maxUploads = SIZE_MAX);
+	bool pending() const { return !requests.empty(); }
+
+private:
+	struct Request {
+		std::future<Image> image;
+		Texture texture;
+		bool flip;
+	};
+	ThreadPool& pool;
+	TextureCache& cache;
+	std::vector<Request> requests;
+};
+
+inline Texture TextureLoader::request(const std::filesystem::path& path, bool flip)
+{
+	Texture texture = cache.find(path, flip);
+	if (texture.data)
+		return texture;
+	// Register the handle now so repeated requests share it
+	texture = Texture::placeholder(path);
+	cache.insert(path, flip, texture);
+	requests.push_back({ pool.submit([path, flip] { return Image::load(path, flip); }),
+		texture, flip });
+	return texture;
+}
+
+inline void TextureLoader::finish()
+{
+	// upload in request order; later decodes keep running meanwhile
+	for (Request& req : requests) {
+		if (!req.texture.upload(req.image.get()))
+			cache.erase(req.texture.filename(), req.flip);
+	}
+	requests.clear();
+}
+
+inline size_t TextureLoader::uploadReady(size_t maxUploads)
+{
+	size_t uploaded = 0;
+	for (auto it = requests.begin(); it != requests.end() && uploaded < maxUploads; ) {
+		if (it->image.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+			++it;
+			continue;
+		}
+		if (!it->texture.upload(it->image.get()))
+			cache.erase(it->texture.filename(), it->flip);
+		it = requests.erase(it);
+		uploaded++;
+	}
+	return uploaded;
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed-size pool of worker threads for CPU-side loading work
+class ThreadPool
+{
+public:
+	explicit ThreadPool(unsigned int numThreads = defaultThreadCount());
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	~ThreadPool();
+
+	template <typename F>
+	auto submit(F&& func) -> std::future<std::invoke_result_t<std::decay_t<F>>>;
+	// Calls func(i) for i in [0, count) and waits for all of them. The calling
+	// thread takes part, so this is safe to use from inside a pool task.
+	template <typename F>
+	void parallelFor(size_t count, F&& func);
+	size_t size() const { return workers.size(); }
+
+	// Pool shared by the loaders, created on first use
+	static ThreadPool& shared();
+	static unsigned int defaultThreadCount() {
+		return std::max(1u, std::thread::hardware_concurrency());
+	}
+
+private:
+	void workerLoop();
+
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool stopping = false;
+};
+
+inline ThreadPool::ThreadPool(unsigned int numThreads)
+{
+	workers.reserve(numThreads);
+	for (unsigned int i = 0; i < numThreads; i++)
+		workers.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+inline ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard lock(mutex);
+		stopping = true;
+	}
+	condition.notify_all();
+	for (auto& worker : workers)
+		worker.join();
+}
+
+template <typename F>
+auto ThreadPool::submit(F&& func) -> std::future<std::invoke_result_t<std::decay_t<F>>>
+{
+	using R = std::invoke_result_t<std::decay_t<F>>;
+	// std::function needs a copyable target, so the task lives in a shared_ptr
+	auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(func));
+	std::future<R> result = task->get_future();
+	{
+		std::lock_guard lock(mutex);
+		tasks.emplace_back([task] { (*task)(); });
+	}
+	condition.notify_one();
+	return result;
+}
+
+template <typename F>
+void ThreadPool::parallelFor(size_t count, F&& func)
+{
+	if (count == 0)
+		return;
+	struct State {
+		std::atomic<size_t> next = 0;
+		std::atomic<size_t> finished = 0;
+		std::mutex mutex;
+		std::condition_variable condition;
+	};
+	// Helpers can start after parallelFor has returned; by then every index is
+	// taken, so they exit without touching func
+	auto state = std::make_shared<State>();
+	auto run = [state, count, &func] {
+		size_t i;
+		while ((i = state->next.fetch_add(1)) < count) {
+			func(i);
+			if (state->finished.fetch_add(1) + 1 == count) {
+				std::lock_guard lock(state->mutex);
+				state->condition.notify_all();
+			}
+		}
+	};
+	size_t helpers = std::min(count - 1, size());
+	for (size_t i = 0; i < helpers; i++)
+		submit(run);
+	run();
+	std::unique_lock lock(state->mutex);
+	state->condition.wait(lock, [&] { return state->finished.load() == count; });
+}
+
+inline ThreadPool& ThreadPool::shared()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+inline void ThreadPool::workerLoop()
+{
+	while (true) {
+		std::function<void()> task;
+		{
+			std::unique_lock lock(mutex);
+			condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+			if (stopping && tasks.empty())
+				return;
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		task();
+	}
+}
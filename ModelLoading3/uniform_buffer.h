@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "gl_handle.h"
+#include "shader.h"
+
+// A uniform buffer holding one std140 block of type T, bound to the block's
+// fixed binding point (see uniform_blocks). Every program that declares the
+// block reads from it, so it is written once per frame for all shaders.
+template <typename T>
+class UniformBuffer
+{
+public:
+	UniformBuffer() : buffer(createBuffer()) {
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer.get());
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(T), nullptr, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_UNIFORM_BUFFER, T::BINDING, buffer.get());
+	}
+
+	// Replaces the whole block. Invalidating lets the driver hand out fresh
+	// storage instead of waiting for draws that still read the old contents.
+	void update(const T& block) {
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer.get());
+		void* data = glMapBufferRange(GL_UNIFORM_BUFFER, 0, sizeof(T),
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (data) {
+			std::memcpy(data, &block, sizeof(T));
+			glUnmapBuffer(GL_UNIFORM_BUFFER);
+		}
+		else {
+			glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(T), &block);
+		}
+	}
+
+private:
+	BufferHandle buffer;
+};
+
+// Per-frame camera data, the Frame block in the shaders
+struct FrameBlock
+{
+	static constexpr GLuint BINDING = uniform_blocks::FRAME;
+
+	glm::mat4 projection;
+	glm::mat4 view;
+	alignas(16) glm::vec3 viewPos;
+};
+
+static_assert(offsetof(FrameBlock, viewPos) == 128);
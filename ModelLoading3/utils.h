@@ -1,9 +1,37 @@
 #pragma once
 #include <array>
+#include <cstdint>
+#include <string_view>
 #include <glad/glad.h>
 
 namespace util {
 
+// 64-bit FNV-1a hash, usable at compile time for string keys
+constexpr uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+constexpr uint64_t FNV_PRIME = 1099511628211ull;
+
+constexpr uint64_t fnv1a(std::string_view s, uint64_t hash = FNV_OFFSET_BASIS) {
+	for (char c : s) {
+		hash ^= uint64_t(static_cast<unsigned char>(c));
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash = FNV_OFFSET_BASIS) {
+	auto bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; i++) {
+		hash ^= uint64_t(bytes[i]);
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+template <typename T>
+inline uint64_t fnv1a_value(const T& value, uint64_t hash) {
+	return fnv1a(&value, sizeof(T), hash);
+}
+
 namespace detail {
 void glGetImpl(GLenum pname, GLint* data) {
 	glGetIntegerv(pname, data);
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+struct Vertex
+{
+	glm::vec3 position;
+	glm::vec3 normal;
+	glm::vec2 texCoords;
+};
+
+// Storage formats for each vertex attribute
+enum class PositionFormat { Float32, Unorm16 };
+enum class NormalFormat { Float32, Oct16, Snorm10 };
+enum class TexCoordFormat { None, Float32, Half };
+
+// Positions are stored as offset + scale * stored value, so that quantized
+// positions can be dequantized by the vertex shader
+struct VertexQuantization
+{
+	glm::vec3 offset = { 0.0f, 0.0f, 0.0f };
+	glm::vec3 scale = { 1.0f, 1.0f, 1.0f };
+};
+
+// Interleaved GPU vertex layout. The default is plain floats, matching Vertex.
+struct VertexFormat
+{
+	PositionFormat position = PositionFormat::Float32;
+	NormalFormat normal = NormalFormat::Float32;
+	TexCoordFormat texCoords = TexCoordFormat::Float32;
+
+	// 16 bytes per vertex (12 without texture coordinates), half of Vertex
+	static VertexFormat compact(bool hasTexCoords = true) {
+		return { PositionFormat::Unorm16, NormalFormat::Oct16,
+			hasTexCoords ? TexCoordFormat::Half : TexCoordFormat::None };
+	}
+	bool operator==(const VertexFormat&) const = default;
+
+	size_t positionSize() const { return position == PositionFormat::Float32 ? 12 : 8; }
+	size_t normalSize() const { return normal == NormalFormat::Float32 ? 12 : 4; }
+	size_t texCoordSize() const {
+		return texCoords == TexCoordFormat::Float32 ? 8 : texCoords == TexCoordFormat::Half ? 4 : 0;
+	}
+	size_t normalOffset() const { return positionSize(); }
+	size_t texCoordOffset() const { return positionSize() + normalSize(); }
+	size_t stride() const { return positionSize() + normalSize() + texCoordSize(); }
+
+	// Sets up attributes 0-2 for the currently bound VAO and array buffer
+	void setupAttributes(size_t baseOffset = 0) const;
+	// Converts to interleaved bytes, returning the position dequantization
+	VertexQuantization pack(const std::vector<Vertex>& vertices,
+		std::vector<unsigned char>& out) const;
+};
+
+namespace detail {
+
+inline int16_t packSnorm16(float v) {
+	return int16_t(std::round(std::clamp(v, -1.0f, 1.0f) * 32767.0f));
+}
+
+inline float signNotZero(float v) {
+	return v >= 0.0f ? 1.0f : -1.0f;
+}
+
+// Octahedral mapping of a unit vector onto [-1, 1]^2. Zero (and NaN)
+// vectors, e.g. normals of degenerate triangles, map to +Z.
+inline glm::vec2 octEncode(glm::vec3 n) {
+	float length = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+	if (!(length > 0.0f))
+		return glm::vec2(0.0f);
+	n /= length;
+	glm::vec2 e(n.x, n.y);
+	if (n.z < 0.0f) {
+		e = glm::vec2((1.0f - std::abs(n.y)) * signNotZero(n.x),
+			(1.0f - std::abs(n.x)) * signNotZero(n.y));
+	}
+	return e;
+}
+
+inline uint32_t packSnorm10(glm::vec3 n) {
+	auto component = [](float v) {
+		return uint32_t(int32_t(std::round(std::clamp(v, -1.0f, 1.0f) * 511.0f))) & 0x3ff;
+	};
+	return component(n.x) | component(n.y) << 10 | component(n.z) << 20;
+}
+
+}
+
+inline void VertexFormat::setupAttributes(size_t baseOffset) const
+{
+	GLsizei s = GLsizei(stride());
+	auto offset = [&](size_t o) { return reinterpret_cast<void*>(baseOffset + o); };
+	// vertex positions
+	glEnableVertexAttribArray(0);
+	if (position == PositionFormat::Float32)
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, s, offset(0));
+	else
+		glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, s, offset(0));
+	// vertex normals
+	glEnableVertexAttribArray(1);
+	if (normal == NormalFormat::Float32)
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, s, offset(normalOffset()));
+	else if (normal == NormalFormat::Oct16)
+		glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, s, offset(normalOffset()));
+	else
+		glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, s, offset(normalOffset()));
+	// vertex texture coords; without them the attribute reads as zero
+	if (texCoords == TexCoordFormat::None) {
+		glDisableVertexAttribArray(2);
+		glVertexAttrib2f(2, 0.0f, 0.0f);
+	}
+	else {
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 2, texCoords == TexCoordFormat::Float32 ? GL_FLOAT : GL_HALF_FLOAT,
+			GL_FALSE, s, offset(texCoordOffset()));
+	}
+}
+
+inline VertexQuantization VertexFormat::pack(const std::vector<Vertex>& vertices,
+	std::vector<unsigned char>& out) const
+{
+	VertexQuantization q;
+	if (position == PositionFormat::Unorm16 && !vertices.empty()) {
+		glm::vec3 lo = vertices[0].position, hi = lo;
+		for (const Vertex& v : vertices) {
+			lo = glm::min(lo, v.position);
+			hi = glm::max(hi, v.position);
+		}
+		q.offset = lo;
+		q.scale = hi - lo;
+	}
+	// a flat extent would divide by zero
+	glm::vec3 invScale = glm::vec3(1.0f) / glm::max(q.scale, glm::vec3(1e-20f));
+
+	size_t s = stride();
+	out.assign(vertices.size() * s, 0);
+	unsigned char* p = out.data();
+	for (const Vertex& v : vertices) {
+		if (position == PositionFormat::Float32) {
+			std::memcpy(p, &v.position, 12);
+		}
+		else {
+			glm::vec3 t = glm::clamp((v.position - q.offset) * invScale, 0.0f, 1.0f);
+			uint16_t packed[4] = { uint16_t(std::round(t.x * 65535.0f)),
+				uint16_t(std::round(t.y * 65535.0f)), uint16_t(std::round(t.z * 65535.0f)), 0 };
+			std::memcpy(p, packed, 8);
+		}
+		unsigned char* n = p + normalOffset();
+		if (normal == NormalFormat::Float32) {
+			std::memcpy(n, &v.normal, 12);
+		}
+		else if (normal == NormalFormat::Oct16) {
+			glm::vec2 e = detail::octEncode(v.normal);
+			int16_t packed[2] = { detail::packSnorm16(e.x), detail::packSnorm16(e.y) };
+			std::memcpy(n, packed, 4);
+		}
+		else {
+			uint32_t packed = detail::packSnorm10(v.normal);
+			std::memcpy(n, &packed, 4);
+		}
+		unsigned char* t = p + texCoordOffset();
+		if (texCoords == TexCoordFormat::Float32) {
+			std::memcpy(t, &v.texCoords, 8);
+		}
+		else if (texCoords == TexCoordFormat::Half) {
+			uint32_t packed = glm::packHalf2x16(v.texCoords);
+			std::memcpy(t, &packed, 4);
+		}
+		p += s;
+	}
+	return q;
+}
+
+// Indices are local to a mesh, so meshes with up to 65536 vertices can use
+// 16-bit indices
+inline GLenum indexTypeFor(size_t vertexCount)
+{
+	return vertexCount <= 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
+
+inline size_t indexSize(GLenum type)
+{
+	return type == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+}
+
+inline void packIndices(const std::vector<unsigned int>& indices, GLenum type,
+	std::vector<unsigned char>& out)
+{
+	if (type == GL_UNSIGNED_SHORT) {
+		out.resize(indices.size() * sizeof(uint16_t));
+		uint16_t* p = reinterpret_cast<uint16_t*>(out.data());
+		for (unsigned int index : indices)
+			*p++ = uint16_t(index);
+	}
+	else {
+		out.resize(indices.size() * sizeof(uint32_t));
+		std::memcpy(out.data(), indices.data(), out.size());
+	}
+}